@@ -25,85 +25,694 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 *******************************************************************/
 
+#include <linux/version.h>
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/uaccess.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
 #include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/math64.h>
 #include <linux/kobject.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/of.h>
+#include <linux/spi/spi.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/list.h>
+#include <linux/firmware.h>
+#include <linux/fb.h>
+#include <linux/vmalloc.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "nokia_5110.h"
+#include "nokia_5110_ioctl.h"
+#include "nokia_5110_convert.h"
+#include "nokia_5110_codec.h"
+
+#define CREATE_TRACE_POINTS
+#include "nokia_5110_trace.h"
+
+// written against the 6.6 LTS API, see "Kernel Requirements" in the README
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 6, 0)
+#error "nokia_5110 needs Linux 6.6 or later"
+#endif
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Michael Ryan");
 MODULE_DESCRIPTION("A driver for the Nokia 5110 display");
 MODULE_VERSION("0.1");
 
-DEFINE_RWLOCK(nokia_lock);
+// guards the list of surfaces and of the SPI devices bound by the driver
+static DEFINE_MUTEX(nokia_spi_lock);
+
+struct nokia_device;
+struct nokia_panel;
 
 static int dev_open(struct inode *, struct file *);
 static int dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t dev_write(struct file *, const char __user *, size_t, loff_t *);
-
-static int command_out(uint8_t *buffer, size_t buffer_len);
-static int data_out(const uint8_t *buffer, size_t buffer_len);
-static int raw_out(const uint8_t *buffer, size_t buffer_len);
-
-static int lcd_init(void);
+static ssize_t dev_write_iter(struct kiocb *, struct iov_iter *);
+static loff_t dev_llseek(struct file *, loff_t, int);
+static long dev_ioctl(struct file *, unsigned int, unsigned long);
+static int dev_mmap(struct file *, struct vm_area_struct *);
+static int dev_fsync(struct file *, loff_t, loff_t, int);
+static __poll_t dev_poll(struct file *, poll_table *);
+static int dev_fasync(int, struct file *, int);
+
+// Transactions
+struct nokia_txn;
+static void txn_init(struct nokia_txn *txn);
+static int txn_command(struct nokia_txn *txn, uint8_t command);
+static int txn_commands(struct nokia_txn *txn, const uint8_t *commands, size_t count);
+static int txn_data(struct nokia_txn *txn, const uint8_t *buffer, size_t buffer_len);
+static int txn_submit(struct nokia_panel *panel, struct nokia_txn *txn);
+static void set_dc(struct nokia_panel *panel, int level);
+
+// Transports
+static int gpio_transport_init(struct nokia_panel *panel);
+static void gpio_transport_exit(struct nokia_panel *panel);
+static int gpio_submit(struct nokia_panel *panel, const struct nokia_txn *txn);
+
+static int spi_transport_init(struct nokia_panel *panel);
+static void spi_transport_exit(struct nokia_panel *panel);
+static int spi_submit(struct nokia_panel *panel, const struct nokia_txn *txn);
+
+// Surfaces and panels
+static int nokia_device_create(int index);
+static void nokia_device_destroy(struct nokia_device *ndev);
+static int nokia_panel_create(struct nokia_device *ndev, int tile);
+static void nokia_panel_destroy(struct nokia_panel *panel);
+static void splash_load(struct nokia_device *ndev);
+static void bringup_worker(struct work_struct *work);
+static void spi_attach(void);
+
+static int lcd_init(struct nokia_panel *panel);
+struct nokia_span;
+static int split_runs(const uint8_t *vbuf, const uint8_t *shadow, int x0, int x1, struct nokia_span *runs);
+static int lcd_flush(struct nokia_panel *panel);
+static void mark_dirty(struct nokia_device *ndev, size_t offset, size_t len);
+static void draw_dirty(struct nokia_device *ndev, size_t offset, size_t len);
+static void vbuffer_write_begin(struct nokia_device *ndev);
+static void vbuffer_write_end(struct nokia_device *ndev);
+static void schedule_flush(struct nokia_device *ndev);
+static void flush_worker(struct work_struct *work);
+static int flush_sync(struct nokia_device *ndev);
+static u32 queue_depth(struct nokia_device *ndev);
+static u32 queue_limit(struct nokia_device *ndev);
+static bool queue_has_room(struct nokia_device *ndev);
+static int queue_wait(struct nokia_device *ndev, bool nonblock);
+static int nokia_flip(struct nokia_device *ndev, unsigned long flags, bool nonblock);
+
+// Framebuffer device
+static int nokia_fb_register(struct nokia_device *ndev);
+static void nokia_fb_unregister(struct nokia_device *ndev);
+static int set_y(struct nokia_txn *txn, int y_pos);
+static int set_x(struct nokia_txn *txn, int x_pos);
 //static int lcd_raw_write(uint8_t *buffer, size_t buffer_len);
-static int lcd_char_write(uint8_t *buffer, size_t buffer_lne);
+static void copy_into_vbuffer(struct nokia_device *ndev, size_t offset, const uint8_t *buffer_in, size_t len);
+static ssize_t convert_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, bool nonblock);
+static ssize_t regions_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, bool nonblock);
+static ssize_t decode_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, u32 format, bool nonblock);
+static int lcd_char_write(struct nokia_device *ndev, uint8_t *buffer, size_t buffer_lne);
+
+// Debugfs
+struct nokia_hist;
+static void hist_add(struct nokia_hist *hist, u64 value);
+static void nokia_debugfs_create(struct nokia_device *ndev);
+
+// Fonts
+struct nokia_font;
+static int font_cache_init(void);
+static void font_cache_exit(void);
+static void render_glyph(struct nokia_device *ndev, const struct nokia_font *font, uint8_t index, int x, int y, bool inverse);
+
+// Sprites
+struct nokia_sprite;
+static int sprite_set(struct nokia_device *ndev, const struct nokia_5110_sprite __user *arg);
+static int sprite_blits(struct nokia_device *ndev, const struct nokia_5110_blits __user *arg, bool nonblock);
+static void sprite_blit(struct nokia_device *ndev, const struct nokia_sprite *sprite, int x, int y, int op);
+
+// Gray planes
+static ssize_t planes_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, u32 format);
+static void planes_start(struct nokia_device *ndev);
+static void planes_stop(struct nokia_device *ndev);
+static enum hrtimer_restart plane_timer_fn(struct hrtimer *timer);
+static void plane_worker(struct work_struct *work);
+
+// Strip chart
+static void chart_reset(struct nokia_device *ndev, const struct nokia_5110_chart *chart);
+static void chart_write(struct nokia_device *ndev, const uint8_t *samples, size_t len);
+static void chart_column(struct nokia_device *ndev, int x, int top, int bottom);
+
+// Layers
+struct nokia_layer;
+struct nokia_file;
+static int layer_set(struct nokia_file *nfile, const struct nokia_5110_layer __user *arg);
+static void layer_remove(struct nokia_file *nfile);
+static void layer_mark(struct nokia_device *ndev, int x0, int y0, int x1, int y1);
+static void layers_composite(struct nokia_device *ndev, size_t offset, size_t len);
+
+// Text console
+struct nokia_console;
+static int console_cols(const struct nokia_console *con);
+static int console_rows(const struct nokia_console *con);
+static void console_set_font(struct nokia_console *con, unsigned int font);
+static void console_putc(struct nokia_console *con, uint8_t c);
+static void console_newline(struct nokia_console *con);
+static void console_clear(struct nokia_console *con);
+static void console_reset(struct nokia_console *con);
+static void console_csi(struct nokia_console *con, uint8_t final);
 
 // Attributes functions
 static ssize_t bias_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t sclk_hz_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t sclk_hz_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+static ssize_t max_fps_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf);
+static ssize_t max_fps_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count);
+
+// Per surface attributes
+static u64 panel_sum(struct nokia_device *ndev, size_t offset);
+static ssize_t width_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t height_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t state_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t bitrate_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t bytes_requested_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t bytes_sent_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t frames_flushed_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t writes_coalesced_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t frames_dropped_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t plane_rate_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t planes_shown_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t planes_missed_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t transactions_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t segments_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t gpio_toggles_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t gpio_writes_show(struct device *dev, struct device_attribute *attr, char *buf);
+
+// most panels one module instance drives
+#define NOKIA_MAX_PANELS 8
+
+/* BeagleBone Black pinouts used.  Each pin parameter takes one GPIO
+per panel, the number of gpio_dc entries sets the number of panels. */
+
+static int gpioDc[NOKIA_MAX_PANELS] = { 44 };
+static int gpioRst[NOKIA_MAX_PANELS] = { 68 };
+static int gpioSce[NOKIA_MAX_PANELS] = { 67 };
+
+static int gpioDout[NOKIA_MAX_PANELS] = { 26 };
+static int gpioSclk[NOKIA_MAX_PANELS] = { 46 };
+
+static int nGpioDc = 1;
+static int nGpioRst = 1;
+static int nGpioSce = 1;
+static int nGpioDout = 1;
+static int nGpioSclk = 1;
+
+module_param_array_named(gpio_dc, gpioDc, int, &nGpioDc, 0444);
+MODULE_PARM_DESC(gpio_dc, "GPIO numbers of the D/C lines, one per panel (default 44)");
+module_param_array_named(gpio_rst, gpioRst, int, &nGpioRst, 0444);
+MODULE_PARM_DESC(gpio_rst, "GPIO numbers of the RST lines (default 68)");
+module_param_array_named(gpio_sce, gpioSce, int, &nGpioSce, 0444);
+MODULE_PARM_DESC(gpio_sce, "GPIO numbers of the SCE lines, gpio transport (default 67)");
+module_param_array_named(gpio_dout, gpioDout, int, &nGpioDout, 0444);
+MODULE_PARM_DESC(gpio_dout, "GPIO numbers of the DIN lines, gpio transport (default 26)");
+module_param_array_named(gpio_sclk, gpioSclk, int, &nGpioSclk, 0444);
+MODULE_PARM_DESC(gpio_sclk, "GPIO numbers of the SCLK lines, gpio transport (default 46)");
+
+// serial clock rate the bit-bang engine paces itself to
+static unsigned int sclkHz = LCD_SCLK_MAX_HZ;
+
+module_param_named(sclk_hz, sclkHz, uint, 0444);
+MODULE_PARM_DESC(sclk_hz, "Bit-bang SCLK rate in Hz (1000 - 4000000, default 4000000)");
+
+// half periods at least this long are slept through rather than spun, below 25 kHz
+#define NOKIA_SCLK_SLEEP_NS 20000
+
+// transport used to clock bytes out to the panel
+static char *transport = "gpio";
+
+module_param(transport, charp, 0444);
+MODULE_PARM_DESC(transport, "Panel transport, \"gpio\" (bit-bang, default) or \"spi\"");
+
+// upper bound on panel refreshes, writes in between are coalesced
+static unsigned int maxFps = 60;
+
+module_param_named(max_fps, maxFps, uint, 0444);
+MODULE_PARM_DESC(max_fps, "Maximum panel refresh rate in frames/s (1 - 1000, default 60)");
+
+#define NOKIA_MAX_FPS 1000
+
+// writes a surface accepts ahead of the panel before writers are held back
+static unsigned int queueDepth = 4;
+
+module_param_named(queue_depth, queueDepth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Writes queued ahead of the panel before write() blocks or fails with EAGAIN (1 - 64, default 4)");
+
+#define NOKIA_MAX_QUEUE_DEPTH 64
+
+/* Bit-planes shown per second by the NOKIA_5110_FMT_FRM_ formats.
+Three planes make one gray frame. */
+static unsigned int planeHz = 180;
+
+module_param_named(plane_hz, planeHz, uint, 0444);
+MODULE_PARM_DESC(plane_hz, "Bit-plane rate of the frame-rate modulated gray formats in planes/s (10 - 1000, default 180)");
+
+#define NOKIA_MIN_PLANE_HZ 10
+#define NOKIA_MAX_PLANE_HZ 1000
+// planes of a 4-level gray frame, a pixel of level n is black in n of them
+#define NOKIA_GRAY_PLANES 3
+
+/* Panels can be tiled into one larger surface, filled row by row.
+Consecutive runs of tile_cols * tile_rows panels each become one
+/dev/nokiaN. */
+static unsigned int tileCols = 1;
+static unsigned int tileRows = 1;
+
+module_param_named(tile_cols, tileCols, uint, 0444);
+MODULE_PARM_DESC(tile_cols, "Panels side by side in each surface (default 1)");
+module_param_named(tile_rows, tileRows, uint, 0444);
+MODULE_PARM_DESC(tile_rows, "Panels stacked in each surface (default 1)");
+
+// register a /dev/fbN view of the panel
+static bool fbdev = true;
+
+module_param(fbdev, bool, 0444);
+MODULE_PARM_DESC(fbdev, "Register an XRGB8888 fbdev framebuffer for the panel (default Y)");
 
-// BeagleBone Black pinouts used
-
-static int gpioDc = 44;
-static int gpioRst = 68;
-static int gpioSce = 67;
+/* Splash screen shown until the first write, loaded as firmware when
+the panels are brought up.  Raw framebuffer bytes, either one panel's
+worth, shown on every tile, or the whole surface. */
+static char *splash = "";
 
-static int gpioDout = 26;
-static int gpioSclk = 46;
+module_param(splash, charp, 0444);
+MODULE_PARM_DESC(splash, "Splash screen firmware file, empty for the built-in one, \"none\" for a blank screen (default empty)");
 
 static uint8_t nokiaBias = 4;
 
-typedef enum
+/* A font is one of the ASCII tables, optionally scaled, with its
+glyphs pre-rendered at every y offset within a bank.  cache holds
+[glyph][y % 8][column] strips, each the column's pixels shifted
+down by y % 8 so they can be split straight into bank bytes. */
+struct nokia_font
+{
+    const uint8_t *glyphs;  // base table, width bytes per glyph, LSB on top
+    uint8_t width;          // columns per glyph in the base table
+    uint8_t height;         // rows per glyph in the base table
+    uint8_t scale;          // pixel doubling, 1 or 2
+    uint8_t advance;        // cell width including spacing
+    uint8_t line_height;    // cell height including spacing
+    u32 *cache;
+    u32 mask[8];            // cell pixels at each y offset
+};
+
+#define NOKIA_FONT_GLYPHS ARRAY_SIZE(ASCII)
+
+static struct nokia_font fonts[] =
+{
+    [NOKIA_5110_FONT_5X8] = { &ASCII[0][0], 5, 8, 1, 6, 8 },
+    [NOKIA_5110_FONT_3X5] = { &ASCII_SMALL[0][0], 3, 5, 1, 4, 6 },
+    [NOKIA_5110_FONT_10X16] = { &ASCII[0][0], 5, 8, 2, 12, 16 },
+    [NOKIA_5110_FONT_6X10] = { &ASCII_SMALL[0][0], 3, 5, 2, 8, 12 }
+};
+
+/* Text mode is a small VT100 subset on a grid of font cells, 14x6
+with the default font.  Each panel keeps its parser state, so escape
+sequences may be split across writes. */
+
+#define NOKIA_CSI_PARAMS 4
+
+enum nokia_console_state
+{
+    CONSOLE_NORMAL = 0,
+    CONSOLE_ESC,
+    CONSOLE_CSI
+};
+
+struct nokia_console
+{
+    int col;                // cursor cell, col == columns means wrap before the next character
+    int row;
+    unsigned int font;      // NOKIA_5110_FONT_ value
+    bool inverse;
+    enum nokia_console_state state;
+    int params[NOKIA_CSI_PARAMS];
+    int nparams;
+};
+
+// bytes of panel RAM, one tile of a surface framebuffer
+const static size_t panel_len = sizeof(displayMap);
+
+// Columns [x0, x1) of a bank that may differ from the panel, clean when x0 >= x1
+struct nokia_span
 {
-	NOKIA_5110_MODE_TEXT = 0,
-	NOKIA_5110_MODE_GRPH = 1,
-	NOKIA_5110_MODE_COM = 3,
-	NOKIA_5110_MODE_END = 4	
-} nokia_5110_mode ;
+    uint8_t x0;
+    uint8_t x1;
+};
 
-// buffer for video
-static uint8_t *VBUFFER = displayMap;
-const static size_t vbuffer_len = sizeof(displayMap);
-static size_t vbuffer_index = 0;
-// buffer for characters
+// flushes framebuffers to the panels outside of the writers' context, unbound so panels refresh in parallel
+static struct workqueue_struct *nokia_wq;
+// longest run of characters taken per write
 const static size_t cbuffer_len = LCD_WIDTH*LCD_HEIGHT/40;
-static char CBUFFER[LCD_WIDTH*LCD_HEIGHT/40] = { 0 };
 
 #define DEVICE_NAME "nokiacdev"
 #define CLASS_NAME "nokia_5110"
 
+/* A transaction is a batch of command and data segments sent under
+a single chip select, with D/C only switched where the kind of segment
+changes.  Command bytes are copied into the transaction, data segments
+point at memory that has to stay put until it is submitted. */
+
+/* A refresh sends up to NOKIA_FLUSH_RUNS bursts per bank, each an
+X address command and a data segment, plus a Y address per bank. */
+#define NOKIA_FLUSH_RUNS 4
+#define NOKIA_TXN_SEGMENTS (2 * LCD_BANKS * NOKIA_FLUSH_RUNS)
+#define NOKIA_TXN_COMMANDS 32
+
+/* Unchanged bytes a burst is split at.  Restarting costs one X address
+byte and two D/C edges, so shorter gaps are cheaper to resend. */
+#define NOKIA_SPLIT_GAP 3
+
+struct nokia_segment
+{
+    int dc;                 // D/C level, 0 for commands and 1 for data
+    const uint8_t *buffer;
+    size_t len;
+};
+
+struct nokia_txn
+{
+    struct nokia_segment seg[NOKIA_TXN_SEGMENTS];
+    int nseg;
+    uint8_t commands[NOKIA_TXN_COMMANDS];
+    int ncommands;
+    size_t bytes;
+};
+
+/* A transport moves transactions to the panel.  D/C and RST always
+stay on GPIO, the transport owns SCE, DIN and SCLK. */
+struct nokia_transport_ops
+{
+    const char *name;
+    int (*init)(struct nokia_panel *panel);
+    void (*exit)(struct nokia_panel *panel);
+    int (*submit)(struct nokia_panel *panel, const struct nokia_txn *txn);
+};
+
+static const struct nokia_transport_ops gpio_transport =
+{
+    .name = "gpio",
+    .init = gpio_transport_init,
+    .exit = gpio_transport_exit,
+    .submit = gpio_submit
+};
+
+static const struct nokia_transport_ops spi_transport =
+{
+    .name = "spi",
+    .init = spi_transport_init,
+    .exit = spi_transport_exit,
+    .submit = spi_submit
+};
+
+static const struct nokia_transport_ops *transports[] =
+{
+    &gpio_transport,
+    &spi_transport
+};
+
+/* log2 histogram, bucket b counts values in [2^(b-1), 2^b), bucket 0
+counts zeros.  Updated locklessly from any panel's worker. */
+#define NOKIA_HIST_BUCKETS 40
+
+struct nokia_hist
+{
+    atomic64_t count[NOKIA_HIST_BUCKETS];
+};
+
+/* One PCD8544 module, showing the tile of its surface that starts
+at column x and bank.  bus_lock serializes the transport and guards
+the shadow and all the counters here.  Each panel has its own flush
+work, so the tiles of a surface are refreshed concurrently. */
+struct nokia_panel
+{
+    int index;                  // position in the pin parameters
+    struct nokia_device *ndev;
+    int x;
+    int bank;
+
+    int gpio_dc;
+    int gpio_rst;
+    int gpio_sce;
+    int gpio_dout;
+    int gpio_sclk;
+
+    // descriptors of the requested lines, all line writes go through these
+    struct gpio_desc *dc;
+    struct gpio_desc *rst;
+    struct gpio_desc *sce;
+    struct gpio_desc *dout;
+    struct gpio_desc *sclk;
+
+    // serializes access to the panel bus, held across transfers that may sleep
+    struct mutex bus_lock;
+
+    // spi transport state
+    struct spi_device *spi;
+    uint8_t *spi_buf;
+
+    // what the panel RAM currently holds
+    uint8_t shadow[LCD_WIDTH*LCD_HEIGHT/8];
+    // the tile as captured by the flush in progress, copied into shadow once it is sent
+    uint8_t frame[LCD_WIDTH*LCD_HEIGHT/8];
+    // frame bytes of a vertical burst, column by column, see flush_vertical()
+    uint8_t columns[LCD_WIDTH*LCD_HEIGHT/8];
+    // transaction being built under bus_lock, too large for the stack
+    struct nokia_txn txn;
+    // in panel coordinates, guarded by the surface lock like the framebuffer
+    struct nokia_span dirty[LCD_BANKS];
+
+    struct delayed_work flush_work;
+    // guarded by the surface lock, read when scheduling
+    ktime_t last_flush;
+    // oldest write not yet picked up by a flush, 0 when none, guarded by the surface lock
+    ktime_t dirty_since;
+    // write sequence numbers of that write and of the oldest one in flight, see queue_depth()
+    u32 dirty_from;
+    u32 flushing_from;
+    bool flushing;
+    // result of the last flush, what fsync() reports
+    int flush_error;
+
+    // last levels driven on D/C, DIN and SCLK, so unchanged levels are not rewritten
+    int dc_level;
+    int din_level;
+    int sclk_level;
+
+    // bus statistics, used to report the achieved bit rate
+    u64 xfer_bits;
+    u64 xfer_ns;
+
+    // transactions submitted, their segments and the SCE and D/C edges they took
+    u64 transactions;
+    u64 segments;
+    u64 gpio_toggles;
+    // line write operations, a combined DIN and SCLK write counts once
+    u64 gpio_writes;
+
+    // bytes actually sent and refreshes that sent any
+    u64 bytes_sent;
+    u64 frames_flushed;
+};
+
+/* Bring-up state of a surface.  /dev/nokiaN appears right away and
+the panels are reset and initialized by bringup_work meanwhile. */
+enum nokia_state
+{
+    NOKIA_STATE_INIT,
+    NOKIA_STATE_READY,
+    NOKIA_STATE_FAILED,
+};
+
+/* One surface, /dev/nokiaN, made of tile_cols x tile_rows panels
+sharing a framebuffer in the panel's bank layout, width bytes per bank.
+lock serializes writers and guards the framebuffer, the dirty spans of
+its panels, write state and the client side counters.  Readers of the
+framebuffer do not take it, they retry on seq instead. */
+struct nokia_device
+{
+    int index;
+    struct device *dev;
+    dev_t dev_no;
+
+    int width;
+    int height;
+    int banks;
+    int cols;                   // tiles per row
+    size_t vbuffer_len;
+
+    struct mutex lock;
+    // bumped around every change to vbuffer under lock, see vbuffer_write_begin()
+    seqcount_mutex_t seq;
+
+    /* enum nokia_state, set by bringup_work, opens wait on wait for it.
+    On spi it goes back to NOKIA_STATE_INIT when a PCD8544 unbinds. */
+    int state;
+    struct work_struct bringup_work;
+    // on spi, set once every panel has a PCD8544 and cleared when one unbinds, guarded by nokia_spi_lock
+    bool bringup_queued;
+
+    // buffer for video, a whole page so it can be mapped into userspace
+    uint8_t *vbuffer;
+    /* what the panels show, vbuffer with the layers composited over
+    it, or vbuffer itself while there are none */
+    uint8_t *scanout;
+    // NOKIA_5110_IOC_SET_LAYER layers, bottom to top
+    struct list_head layers;
+    /* back buffer of NOKIA_5110_IOC_SET_BUFFERING, also a page, and
+    where drawing lands, vbuffer or back */
+    uint8_t *back;
+    uint8_t *draw;
+
+    // what write() takes, selected with NOKIA_5110_IOC_SET_MODE
+    nokia_5110_mode mode;
+    // how graphics mode writes are laid out, selected with NOKIA_5110_IOC_SET_FORMAT
+    struct nokia_5110_format format;
+    struct nokia_console console;
+    // NOKIA_5110_IOC_SET_CHART settings, the column the next sample goes to and the row of the last one
+    struct nokia_5110_chart chart;
+    int chart_x;
+    int chart_last;
+    // NOKIA_5110_IOC_SET_SPRITE bitmaps
+    struct nokia_sprite *sprites[NOKIA_5110_SPRITES];
+
+    /* bit-planes of the last NOKIA_5110_FMT_FRM_ frame, vbuffer_len
+    bytes each, copied into vbuffer in turn on every plane_timer period */
+    uint8_t *planes;
+    int plane;
+    struct hrtimer plane_timer;
+    struct work_struct plane_work;
+    // timer periods elapsed since plane_work last ran, updated by the timer
+    atomic_t plane_ticks;
+    // planes handed to the panels, and periods that had to keep the previous one
+    u64 planes_shown;
+    u64 planes_missed;
+    // achieved planes/s, measured over windows of a second
+    u32 plane_rate;
+    ktime_t plane_window;
+    u64 plane_window_shown;
+
+    // fbdev view, see Framebuffer Device
+    struct fb_info *fb;
+    u32 fb_palette[16];
+    // deferred IO keeps its page list and lock in here, so every surface needs its own
+    struct fb_deferred_io fb_defio;
+    // 1-bpp staging rows for conversion, protected by lock
+    uint8_t *fb_mono;
+    // rows [fb_y0, fb_y1) changed by drawing ops, waiting for deferred IO
+    spinlock_t fb_lock;
+    int fb_y0;
+    int fb_y1;
+
+    // framebuffer bytes written, and writes folded into an already pending refresh
+    u64 bytes_requested;
+    u64 writes_coalesced;
+    // flips that replaced a frame before it reached the panel
+    u64 frames_dropped;
+
+    // writes accepted, and panel refreshes that changed the display
+    u32 write_seq;
+    u32 presented;
+    // woken when a refresh completes, for writers held back and poll()
+    wait_queue_head_t wait;
+    struct fasync_struct *fasync;
+
+    // debugfs view, write to visible latency and bus time per byte in ns
+    struct dentry *debugfs;
+    struct nokia_hist write_latency;
+    struct nokia_hist byte_time;
+
+    struct nokia_panel *panels[NOKIA_MAX_PANELS];
+    int npanels;
+};
+
+/* A sprite slot's bitmap, laid out like the framebuffer, width
+bytes per 8-row band */
+struct nokia_sprite
+{
+    int width;
+    int height;
+    uint8_t bits[];
+};
+
+/* A file's layer, composited over the framebuffer within the window
+[x0, x1) x [y0, y1) in surface pixels.  Guarded by the surface lock. */
+struct nokia_layer
+{
+    struct list_head node;
+    int z;
+    bool visible;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    // vbuffer_len bytes, laid out like the framebuffer
+    uint8_t bits[];
+};
+
+/* Per open file state */
+struct nokia_file
+{
+    struct nokia_device *ndev;
+    // refreshes seen by the last NOKIA_5110_IOC_PRESENTED, poll() raises POLLPRI when more completed
+    u32 presented_seen;
+    // set by the first NOKIA_5110_IOC_SET_LAYER, kept until the file is closed
+    struct nokia_layer *layer;
+};
+
 static struct nokia_struct
 {
     int majorNo;
     struct class *class;
-    struct device *dev;
     struct kobject *kobject;
-    dev_t dev_no;
+
+    const struct nokia_transport_ops *ops;
+
+    struct nokia_device *devices[NOKIA_MAX_PANELS];
+    int ndevices;
+
+    // PCD8544s bound by the SPI driver, claimed by panels in probe order
+    struct spi_device *spi_bound[NOKIA_MAX_PANELS];
+
+    // debugfs directory, one subdirectory per surface
+    struct dentry *debugfs;
 
 } nokia = {0};
 
 static struct file_operations fops =
 {
+    .owner = THIS_MODULE,
     .open = dev_open,
     .read = dev_read,
-    .write = dev_write,
+    .write_iter = dev_write_iter,
+    .llseek = dev_llseek,
+    .unlocked_ioctl = dev_ioctl,
+    .compat_ioctl = dev_ioctl,
+    .mmap = dev_mmap,
+    .fsync = dev_fsync,
+    .poll = dev_poll,
+    .fasync = dev_fasync,
     .release = dev_release
 };
 
@@ -112,9 +721,17 @@ static struct file_operations fops =
 static struct kobj_attribute bias_attr =
 __ATTR_RO(bias);
 
+static struct kobj_attribute sclk_hz_attr =
+__ATTR_RW(sclk_hz);
+
+static struct kobj_attribute max_fps_attr =
+__ATTR_RW(max_fps);
+
 static struct attribute *nokia_attrs[] = 
 {
     &bias_attr.attr,
+    &sclk_hz_attr.attr,
+    &max_fps_attr.attr,
     NULL,
 };
 
@@ -123,115 +740,272 @@ static struct attribute_group nokia_attr_group =
     .attrs = nokia_attrs
 };
 
+/* Per surface attributes, under /sys/class/nokia_5110/nokiaN.  Bus
+counters are summed over the surface's panels. */
+
+static struct device_attribute width_attr =
+__ATTR_RO(width);
+
+static struct device_attribute height_attr =
+__ATTR_RO(height);
+
+static struct device_attribute state_attr =
+__ATTR_RO(state);
+
+static struct device_attribute bitrate_attr =
+__ATTR_RO(bitrate);
+
+static struct device_attribute bytes_requested_attr =
+__ATTR_RO(bytes_requested);
+
+static struct device_attribute bytes_sent_attr =
+__ATTR_RO(bytes_sent);
+
+static struct device_attribute frames_flushed_attr =
+__ATTR_RO(frames_flushed);
+
+static struct device_attribute writes_coalesced_attr =
+__ATTR_RO(writes_coalesced);
+
+static struct device_attribute frames_dropped_attr =
+__ATTR_RO(frames_dropped);
+
+static struct device_attribute plane_rate_attr =
+__ATTR_RO(plane_rate);
+
+static struct device_attribute planes_shown_attr =
+__ATTR_RO(planes_shown);
+
+static struct device_attribute planes_missed_attr =
+__ATTR_RO(planes_missed);
+
+static struct device_attribute transactions_attr =
+__ATTR_RO(transactions);
+
+static struct device_attribute segments_attr =
+__ATTR_RO(segments);
+
+static struct device_attribute gpio_toggles_attr =
+__ATTR_RO(gpio_toggles);
+
+static struct device_attribute gpio_writes_attr =
+__ATTR_RO(gpio_writes);
+
+static struct attribute *nokia_dev_attrs[] = 
+{
+    &width_attr.attr,
+    &height_attr.attr,
+    &state_attr.attr,
+    &bitrate_attr.attr,
+    &bytes_requested_attr.attr,
+    &bytes_sent_attr.attr,
+    &frames_flushed_attr.attr,
+    &writes_coalesced_attr.attr,
+    &frames_dropped_attr.attr,
+    &plane_rate_attr.attr,
+    &planes_shown_attr.attr,
+    &planes_missed_attr.attr,
+    &transactions_attr.attr,
+    &segments_attr.attr,
+    &gpio_toggles_attr.attr,
+    &gpio_writes_attr.attr,
+    NULL,
+};
+
+static struct attribute_group nokia_dev_attr_group = 
+{
+    .attrs = nokia_dev_attrs
+};
+
+static const struct attribute_group *nokia_dev_attr_groups[] =
+{
+    &nokia_dev_attr_group,
+    NULL,
+};
+
+/* SPI driver, binds the panel when the spi transport is selected */
+
+static int nokia_spi_probe(struct spi_device *spi);
+static void nokia_spi_remove(struct spi_device *spi);
+
+static const struct of_device_id nokia_of_match[] =
+{
+    { .compatible = "philips,pcd8544" },
+    { }
+};
+MODULE_DEVICE_TABLE(of, nokia_of_match);
+
+static const struct spi_device_id nokia_spi_ids[] =
+{
+    { "pcd8544", 0 },
+    { }
+};
+MODULE_DEVICE_TABLE(spi, nokia_spi_ids);
+
+static struct spi_driver nokia_spi_driver =
+{
+    .driver =
+    {
+        .name = "nokia_5110",
+        .of_match_table = nokia_of_match,
+    },
+    .id_table = nokia_spi_ids,
+    .probe = nokia_spi_probe,
+    .remove = nokia_spi_remove
+};
+
 /*   Module Initiazlization and Exit */
 
 // INIT
 static int __init nokia_5110_init(void)
 {
     int ret;
-    unsigned long now = get_jiffies_64();
-    unsigned long delta = 5 * HZ / 10000;
-    unsigned long next = now + delta;
+    int i;
 
     printk(KERN_INFO "Opening the Nokia 5110 driver\n");
 
-    printk(KERN_INFO "Configuring the pins\n");
+    if (sclkHz < LCD_SCLK_MIN_HZ || sclkHz > LCD_SCLK_MAX_HZ)
+    {
+        printk(KERN_WARNING "SCLK rate %u Hz out of range, using %u Hz", sclkHz, LCD_SCLK_MAX_HZ);
+        sclkHz = LCD_SCLK_MAX_HZ;
+    }
 
-    rwlock_init(&nokia_lock);
+    maxFps = clamp_val(maxFps, 1, NOKIA_MAX_FPS);
+    planeHz = clamp_val(planeHz, NOKIA_MIN_PLANE_HZ, NOKIA_MAX_PLANE_HZ);
+    queueDepth = clamp_val(queueDepth, 1, NOKIA_MAX_QUEUE_DEPTH);
 
-    // generic output pins
+    for (i = 0; i < ARRAY_SIZE(transports); i++)
+    {
+        if (sysfs_streq(transport, transports[i]->name))
+        {
+            nokia.ops = transports[i];
+        }
+    }
 
-    gpio_request(gpioRst, "sysfs");
-    gpio_direction_output(gpioRst, 0);
+    if (!nokia.ops)
+    {
+        printk(KERN_ALERT "\033[31mUnknown transport %s\033[0m", transport);
+        return -EINVAL;
+    }
 
-    while (!time_after(now, next))
+    // every panel needs its full set of lines
+    if (nGpioRst != nGpioDc ||
+        (nokia.ops == &gpio_transport && (nGpioSce != nGpioDc || nGpioDout != nGpioDc || nGpioSclk != nGpioDc)))
     {
-        now = get_jiffies_64();
+        printk(KERN_ALERT "\033[31mPin parameters do not describe %d panels\033[0m", nGpioDc);
+        return -EINVAL;
     }
 
-    gpio_set_value(gpioRst, 1);
+    // whole surfaces only
+    if (tileCols < 1 || tileRows < 1 || nGpioDc % (tileCols * tileRows))
+    {
+        printk(KERN_ALERT "\033[31m%d panels do not make %ux%u tiled surfaces\033[0m", nGpioDc, tileCols, tileRows);
+        return -EINVAL;
+    }
 
-    gpio_request(gpioSce, "sysfs");
-    gpio_direction_output(gpioSce, 1);
-    gpio_request(gpioDc, "sysfs");
-    gpio_direction_output(gpioDc, 0);
+    ret = font_cache_init();
+    if (ret)
+    {
+        return ret;
+    }
 
-    // Data and Clock
-    gpio_request(gpioSclk, "sysfs");
-    gpio_direction_output(gpioSclk, 0);
-    gpio_request(gpioDout, "sysfs");
-    gpio_direction_output(gpioDout, 0);
+    nokia_wq = alloc_workqueue("nokia_5110", WQ_UNBOUND, 0);
+    if (!nokia_wq)
+    {
+        ret = -ENOMEM;
+        goto err_fonts;
+    }
 
-    printk(KERN_INFO "Done with configuring pins\n");
     printk(KERN_INFO "Initializing chardev\n");
 
     nokia.majorNo = register_chrdev(0, DEVICE_NAME, &fops);
     if (nokia.majorNo < 0)
     {
         printk(KERN_ALERT "\033[31mNokia 5110 driver failed to register.\n\033[0m");
-        return nokia.majorNo;
+        ret = nokia.majorNo;
+        goto err_wq;
     }
 
     printk(KERN_INFO "Major No. %d create for nokia device", nokia.majorNo);
     printk(KERN_INFO "Creating nokia class.");
-    nokia.class = class_create(THIS_MODULE, CLASS_NAME);
+    nokia.class = class_create(CLASS_NAME);
     if (IS_ERR(nokia.class))
     {
         printk(KERN_ALERT "\033[31mCould not register class for %d\033[0m", nokia.majorNo);
-        unregister_chrdev(nokia.majorNo, DEVICE_NAME);
-        return PTR_ERR(nokia.class);
-    }
-
-    printk(KERN_INFO "Create device.");
-
-    nokia.dev_no = MKDEV(nokia.majorNo, 0);
-    register_chrdev_region(nokia.dev_no, 1, DEVICE_NAME);
-    nokia.dev = device_create(nokia.class, NULL, nokia.dev_no, NULL, "nokia%d", 0);
-    printk(KERN_INFO "Device created.");
-    if (IS_ERR(nokia.dev))
-    {
-        printk(KERN_ALERT "\033[31mCould not create nokia device.\033[0m");
-        class_destroy(nokia.class);
-        unregister_chrdev(nokia.majorNo, DEVICE_NAME);
-        return PTR_ERR(nokia.class);
+        ret = PTR_ERR(nokia.class);
+        goto err_chrdev;
     }
 
     printk(KERN_INFO "Creating kobject interface");
     nokia.kobject = kobject_create_and_add("nokia_5110", NULL);
-    if (IS_ERR(nokia.kobject))
+    if (!nokia.kobject)
     {
         printk(KERN_ALERT "\033[31mCould not create kobject\033[0m");
-        class_unregister(nokia.class);
-        class_destroy(nokia.class);
-        unregister_chrdev(nokia.majorNo, DEVICE_NAME);
-        return PTR_ERR(nokia.kobject);
+        ret = -ENOMEM;
+        goto err_class;
     }
 
     ret = sysfs_create_group(nokia.kobject, &nokia_attr_group);
     if(ret) {
         printk(KERN_ALERT "\033[31mFailed to create attr group\033[0m");
-        class_unregister(nokia.class);
-        class_destroy(nokia.class);
-        unregister_chrdev(nokia.majorNo, DEVICE_NAME);
-        kobject_put(nokia.kobject);
-        return ret;
+        goto err_kobject;
     }
 
-    printk(KERN_INFO "\033[32mnokia_5110 succesfully initialized.\033[0m");
-
-    if (lcd_init() == 0)
+    if (nokia.ops == &spi_transport)
     {
-        printk(KERN_INFO "\033[32mLCD Initialized.\033[0m");
+        ret = spi_register_driver(&nokia_spi_driver);
+        if (ret)
+        {
+            goto err_kobject;
+        }
     }
-    else
+
+    // debugfs is optional, failures are ignored
+    nokia.debugfs = debugfs_create_dir("nokia_5110", NULL);
+
+    for (i = 0; i < nGpioDc / (tileCols * tileRows); i++)
     {
-        printk(KERN_ALERT "\033[31mCould not initialize LCD control.\033[0m");
-        class_unregister(nokia.class);
-        class_destroy(nokia.class);
-        unregister_chrdev(nokia.majorNo, DEVICE_NAME);
+        ret = nokia_device_create(i);
+        if (ret)
+        {
+            printk(KERN_ALERT "\033[31mCould not bring up nokia%d\033[0m", i);
+            goto err_devices;
+        }
     }
 
+    printk(KERN_INFO "\033[32mnokia_5110 succesfully initialized, %d panel(s) on %s transport.\033[0m", nGpioDc, nokia.ops->name);
+
     return 0;
+
+err_devices:
+    // unbinding first keeps probe away from the surfaces torn down
+    if (nokia.ops == &spi_transport)
+    {
+        spi_unregister_driver(&nokia_spi_driver);
+    }
+    while (nokia.ndevices)
+    {
+        struct nokia_device *ndev;
+
+        // unpublished first, sclk_hz_store() walks the list
+        mutex_lock(&nokia_spi_lock);
+        ndev = nokia.devices[--nokia.ndevices];
+        mutex_unlock(&nokia_spi_lock);
+        nokia_device_destroy(ndev);
+    }
+    debugfs_remove_recursive(nokia.debugfs);
+err_kobject:
+    kobject_put(nokia.kobject);
+err_class:
+    class_destroy(nokia.class);
+err_chrdev:
+    unregister_chrdev(nokia.majorNo, DEVICE_NAME);
+err_wq:
+    destroy_workqueue(nokia_wq);
+err_fonts:
+    font_cache_exit();
+
+    return ret;
 }
 
 // EXIT
@@ -239,264 +1013,3845 @@ static void __exit nokia_5110_exit(void)
 {
     printk(KERN_INFO "\033[31mExiting the Nokia 5110 driver\033[0m");
 
-    gpio_unexport(gpioDc);
-    gpio_unexport(gpioRst);
-    gpio_unexport(gpioSce);
-
-    gpio_unexport(gpioDout);
-    gpio_unexport(gpioSclk);
+    // unbinding first keeps probe away from the surfaces torn down
+    if (nokia.ops == &spi_transport)
+    {
+        spi_unregister_driver(&nokia_spi_driver);
+    }
 
-    gpio_free(gpioDc);
-    gpio_free(gpioRst);
-    gpio_free(gpioSce);
+    while (nokia.ndevices)
+    {
+        struct nokia_device *ndev;
 
-    gpio_free(gpioDout);
-    gpio_free(gpioSclk);
+        // unpublished first, sclk_hz_store() walks the list
+        mutex_lock(&nokia_spi_lock);
+        ndev = nokia.devices[--nokia.ndevices];
+        mutex_unlock(&nokia_spi_lock);
+        nokia_device_destroy(ndev);
+    }
+    debugfs_remove_recursive(nokia.debugfs);
 
-    device_destroy(nokia.class, nokia.dev_no);
-    class_unregister(nokia.class);
+    kobject_put(nokia.kobject);
     class_destroy(nokia.class);
     unregister_chrdev(nokia.majorNo, DEVICE_NAME);
-    kobject_put(nokia.kobject);
+    destroy_workqueue(nokia_wq);
+    font_cache_exit();
     printk(KERN_INFO "Devices unregistered and released.\n");
 }
 
 module_init(nokia_5110_init);
 module_exit(nokia_5110_exit);
 
- /***************** Device Controls *****************/
-
-static int dev_open(struct inode *pinode, struct file *filep)
-{
-    int ret = 0;
-
-    return ret;
-}
+ /***************** Surfaces and Panels *****************/
 
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset)
+/********************************************************
+ *
+ * Brings up one surface: allocates its framebuffer,
+ *  brings up its panels and creates /dev/nokiaN
+ *  params: 
+ *       index - surface number, its panels follow on from
+ *               index * tile_cols * tile_rows in the pin
+ *               parameters
+ *       
+ *********************************************************/
+static int nokia_device_create(int index)
 {
-    size_t num_copy = len;
-    int err = 0;
+    struct nokia_device *ndev;
+    int bank, tile;
+    int ret;
 
-    if (*offset >= vbuffer_len)
+    ndev = kzalloc(sizeof(*ndev), GFP_KERNEL);
+    if (!ndev)
     {
-        return 0;
+        return -ENOMEM;
     }
 
-    if (len == 0 || !buffer)
+    ndev->index = index;
+    ndev->cols = tileCols;
+    ndev->width = LCD_WIDTH * tileCols;
+    ndev->height = LCD_HEIGHT * tileRows;
+    ndev->banks = ndev->height / 8;
+    ndev->vbuffer_len = ndev->width * ndev->banks;
+
+    mutex_init(&ndev->lock);
+    seqcount_mutex_init(&ndev->seq, &ndev->lock);
+    init_waitqueue_head(&ndev->wait);
+    INIT_WORK(&ndev->bringup_work, bringup_worker);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&ndev->plane_timer, plane_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&ndev->plane_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ndev->plane_timer.function = plane_timer_fn;
+#endif
+    INIT_WORK(&ndev->plane_work, plane_worker);
+
+    ndev->mode = NOKIA_5110_MODE_TEXT;
+    ndev->format.format = NOKIA_5110_FMT_NATIVE;
+    ndev->format.threshold = 128;
+    ndev->console.font = NOKIA_5110_FONT_5X8;
+    ndev->chart_last = -1;
+
+    // NOKIA_MAX_PANELS tiles still fit in the one mappable page
+    ndev->vbuffer = (uint8_t *)get_zeroed_page(GFP_KERNEL);
+    if (!ndev->vbuffer)
     {
-        printk(KERN_ALERT "Invalid buffer.");
-        return -EFAULT;
+        kfree(ndev);
+        return -ENOMEM;
     }
+    ndev->back = (uint8_t *)get_zeroed_page(GFP_KERNEL);
+    if (!ndev->back)
+    {
+        ret = -ENOMEM;
+        goto err_vbuffer;
+    }
+    ndev->draw = ndev->vbuffer;
+    ndev->scanout = ndev->vbuffer;
+    INIT_LIST_HEAD(&ndev->layers);
 
-    num_copy = (vbuffer_len > len + *offset) ? len : vbuffer_len - *offset;
-
-    read_lock(&nokia_lock);
-    err = copy_to_user(buffer, VBUFFER + *offset, num_copy);
-    read_unlock(&nokia_lock);
-
-    return err;
-}
-
-static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset)
-{
-    size_t num_copy = len;
-    size_t num_not_copied = 0;
+    // every tile starts out showing the splash screen
+    for (bank = 0; bank < ndev->banks; bank++)
+    {
+        for (tile = 0; tile < ndev->cols; tile++)
+        {
+            memcpy(&ndev->vbuffer[bank * ndev->width + tile * LCD_WIDTH], &displayMap[(bank % LCD_BANKS) * LCD_WIDTH], LCD_WIDTH);
+        }
+    }
 
+    for (tile = 0; tile < tileCols * tileRows; tile++)
+    {
+        ret = nokia_panel_create(ndev, tile);
+        if (ret)
+        {
+            goto err_panels;
+        }
+    }
 
-    if (*offset >= cbuffer_len)
+    ndev->dev_no = MKDEV(nokia.majorNo, index);
+    ndev->dev = device_create_with_groups(nokia.class, NULL, ndev->dev_no, ndev, nokia_dev_attr_groups, "nokia%d", index);
+    if (IS_ERR(ndev->dev))
     {
-        return 0;
+        printk(KERN_ALERT "\033[31mCould not create nokia device.\033[0m");
+        ret = PTR_ERR(ndev->dev);
+        goto err_panels;
     }
 
-    if (len == 0 || !buffer)
+    if (fbdev && nokia_fb_register(ndev) != 0)
     {
-        printk(KERN_ALERT "Invalid buffer.");
-        return -EFAULT;
+        printk(KERN_WARNING "\033[31mCould not register framebuffer device\033[0m");
     }
 
-    num_copy = (cbuffer_len > len + *offset) ? len : cbuffer_len - *offset;
+    nokia_debugfs_create(ndev);
 
-    write_lock(&nokia_lock);
-    num_not_copied = copy_from_user(CBUFFER + *offset, buffer, num_copy);
+    // the panels come up off the module load path, on spi once a PCD8544 is bound for each
+    mutex_lock(&nokia_spi_lock);
+    nokia.devices[nokia.ndevices++] = ndev;
+    if (nokia.ops == &spi_transport)
+    {
+        spi_attach();
+        if (!ndev->bringup_queued)
+        {
+            printk(KERN_INFO "nokia%d waits for its PCD8544s to bind on SPI", index);
+        }
+    }
+    else
+    {
+        queue_work(nokia_wq, &ndev->bringup_work);
+    }
+    mutex_unlock(&nokia_spi_lock);
 
-    lcd_char_write(CBUFFER, num_copy);
-    write_unlock(&nokia_lock);
+    return 0;
 
-    printk(KERN_INFO "Print %u bytes and %llu", num_copy, *offset);
+err_panels:
+    while (ndev->npanels)
+    {
+        nokia_panel_destroy(ndev->panels[--ndev->npanels]);
+    }
+    free_page((unsigned long)ndev->back);
+err_vbuffer:
+    free_page((unsigned long)ndev->vbuffer);
+    kfree(ndev);
 
-    return num_copy - num_not_copied;
+    return ret;
 }
 
-static int dev_release(struct inode *pinode, struct file *filep)
+static void nokia_device_destroy(struct nokia_device *ndev)
 {
-    return 0;
-}
-
- /***************** LCD Controls *****************/
-
+    int i;
 
-// Initializes the lcd 
- static int lcd_init(void)
-{
-    // default startup settings
-    uint8_t init_commands[] = {LCD_COMMAND_FUNCT_SET | 0x01,
-                               LCD_COMMAND_Vop | 0x30,
-                               LCD_COMMAND_TEMP_CTRL,
-                               LCD_COMMAND_BIAS_SYS | nokiaBias,
-                               LCD_COMMAND_FUNCT_SET,
-                               LCD_COMMAND_DISP_CTRL | 0x04};
+    cancel_work_sync(&ndev->bringup_work);
+    planes_stop(ndev);
+    debugfs_remove_recursive(ndev->debugfs);
+    nokia_fb_unregister(ndev);
+    device_destroy(nokia.class, ndev->dev_no);
 
-    printk(KERN_INFO "\033[32mInitializing LCD and setting pins.\033[0m");
+    while (ndev->npanels)
+    {
+        nokia_panel_destroy(ndev->panels[--ndev->npanels]);
+    }
 
-    printk(KERN_INFO "Sending commands.");
-    command_out(init_commands, 6);
+    for (i = 0; i < NOKIA_5110_SPRITES; i++)
+    {
+        kfree(ndev->sprites[i]);
+    }
 
-    // write default screen 
-    return data_out(displayMap, sizeof(displayMap));
+    free_page((unsigned long)ndev->back);
+    free_page((unsigned long)ndev->vbuffer);
+    kfree(ndev);
 }
 
-static int copy_into_vbuffer(uint8_t * buffer_in, size_t bytes_to_copy)
+/********************************************************
+ *
+ * Claims the GPIO of one panel line and drives it to
+ *  level.  A mistyped number or a pin already claimed,
+ *  e.g. by another panel, fails rather than leaving the
+ *  panel with no descriptor or a shared one.
+ *  params: 
+ *       gpio - legacy GPIO number from the pin parameters
+ *       label - line name, for the claim and the log
+ *       level - initial output level
+ *       desc - set to the line's descriptor
+ *       
+ *********************************************************/
+static int panel_line_request(int gpio, const char *label, int level, struct gpio_desc **desc)
 {
-    int num_to_copy = bytes_to_copy;
+    int ret;
 
-    while( bytes_to_copy )
+    ret = gpio_request(gpio, label);
+    if (ret)
     {
-        num_to_copy = bytes_to_copy;
-        if ( bytes_to_copy + vbuffer_index > vbuffer_len )
-        {
-            num_to_copy = vbuffer_len - vbuffer_index ;
-        }
-        memcpy(&VBUFFER[vbuffer_index], buffer_in, num_to_copy);
-        data_out(&VBUFFER[vbuffer_index], num_to_copy);
-        vbuffer_index += num_to_copy;
-    
-        if( vbuffer_index >= vbuffer_len )
-        {
-            vbuffer_index = vbuffer_index-vbuffer_len;
-        }
-        bytes_to_copy -= num_to_copy;
+        printk(KERN_ALERT "\033[31mCould not claim GPIO %d for %s: %d\033[0m", gpio, label, ret);
+        return ret;
+    }
+
+    *desc = gpio_to_desc(gpio);
+    if (!*desc)
+    {
+        printk(KERN_ALERT "\033[31mNo descriptor for GPIO %d (%s)\033[0m", gpio, label);
+        ret = -EINVAL;
+        goto err_free;
+    }
+
+    ret = gpiod_direction_output(*desc, level);
+    if (ret)
+    {
+        printk(KERN_ALERT "\033[31mCould not drive GPIO %d (%s): %d\033[0m", gpio, label, ret);
+        goto err_free;
     }
 
     return 0;
+
+err_free:
+    gpio_free(gpio);
+    *desc = NULL;
+
+    return ret;
 }
 
 /********************************************************
  *
- * Writes a character to 8x5 rectangle at current position
+ * Brings up one panel of a surface: resets it, starts
+ *  its transport and sends it its tile
  *  params: 
- *       buffer - ASCII character array
- *       buffer_len - number of bytes in buffer    
+ *       ndev - surface the panel belongs to
+ *       tile - position within the surface, row by row
  *       
  *********************************************************/
-static int lcd_char_write(uint8_t *buffer, size_t buffer_len)
+static int nokia_panel_create(struct nokia_device *ndev, int tile)
 {
-    const uint8_t *out_bits = NULL;
-    int escaped = 0;
+    struct nokia_panel *panel;
+    const int index = ndev->index * tileCols * tileRows + tile;
+    int ret;
 
-    while (buffer_len)
+    panel = kzalloc(sizeof(*panel), GFP_KERNEL);
+    if (!panel)
     {
-        uint8_t index = *buffer - 0x20;
-        if (index < 0x5F)
-        {
-            out_bits = ASCII[index];
+        return -ENOMEM;
+    }
 
-            copy_into_vbuffer(out_bits, 5);
-            gpio_set_value(gpioSce, 1);
+    panel->index = index;
+    panel->ndev = ndev;
+    panel->x = (tile % ndev->cols) * LCD_WIDTH;
+    panel->bank = (tile / ndev->cols) * LCD_BANKS;
+
+    panel->gpio_dc = gpioDc[index];
+    panel->gpio_rst = gpioRst[index];
+    panel->gpio_sce = gpioSce[index];
+    panel->gpio_dout = gpioDout[index];
+    panel->gpio_sclk = gpioSclk[index];
+
+    mutex_init(&panel->bus_lock);
+    INIT_DELAYED_WORK(&panel->flush_work, flush_worker);
+
+    printk(KERN_INFO "Configuring the pins of panel %d\n", index);
+
+    // generic output pins, the panel is held in reset until bringup_work releases it
+
+    ret = panel_line_request(panel->gpio_rst, "nokia_5110 rst", 0, &panel->rst);
+    if (ret)
+    {
+        goto err_panel;
+    }
+
+    ret = panel_line_request(panel->gpio_dc, "nokia_5110 dc", 0, &panel->dc);
+    if (ret)
+    {
+        goto err_rst;
+    }
+    panel->dc_level = 0;
+
+    // Chip select, Data and Clock
+    ret = nokia.ops->init(panel);
+    if (ret)
+    {
+        printk(KERN_ALERT "\033[31mCould not initialize %s transport\033[0m", nokia.ops->name);
+        goto err_dc;
+    }
+
+    ndev->panels[ndev->npanels++] = panel;
+
+    return 0;
+
+err_dc:
+    gpio_free(panel->gpio_dc);
+err_rst:
+    gpio_free(panel->gpio_rst);
+err_panel:
+    kfree(panel);
+
+    return ret;
+}
+
+static void nokia_panel_destroy(struct nokia_panel *panel)
+{
+    cancel_delayed_work_sync(&panel->flush_work);
+
+    gpio_unexport(panel->gpio_dc);
+    gpio_unexport(panel->gpio_rst);
+
+    gpio_free(panel->gpio_dc);
+    gpio_free(panel->gpio_rst);
+
+    nokia.ops->exit(panel);
+    kfree(panel);
+}
+
+/********************************************************
+ *
+ * Replaces the built-in splash with the splash module
+ *  parameter's.  A missing or odd sized file keeps the
+ *  built-in one.  The usermode helper is not used, so a
+ *  missing file does not hold up the bring-up.
+ *       
+ *********************************************************/
+static void splash_load(struct nokia_device *ndev)
+{
+    const struct firmware *fw;
+    int bank, tile;
+
+    if (!splash[0])
+    {
+        return;
+    }
+
+    if (sysfs_streq(splash, "none"))
+    {
+        mutex_lock(&ndev->lock);
+        vbuffer_write_begin(ndev);
+        memset(ndev->vbuffer, 0, ndev->vbuffer_len);
+        vbuffer_write_end(ndev);
+        mutex_unlock(&ndev->lock);
+        return;
+    }
+
+    if (request_firmware_direct(&fw, splash, ndev->dev))
+    {
+        printk(KERN_WARNING "\033[31mCould not load splash %s, using the built-in one\033[0m", splash);
+        return;
+    }
+    if (fw->size != panel_len && fw->size != ndev->vbuffer_len)
+    {
+        printk(KERN_WARNING "\033[31mSplash %s is %zu bytes, expected %zu or %zu\033[0m", splash, fw->size, panel_len, ndev->vbuffer_len);
+        release_firmware(fw);
+        return;
+    }
+
+    mutex_lock(&ndev->lock);
+    vbuffer_write_begin(ndev);
+    if (fw->size == ndev->vbuffer_len)
+    {
+        memcpy(ndev->vbuffer, fw->data, fw->size);
+    }
+    else
+    {
+        for (bank = 0; bank < ndev->banks; bank++)
+        {
+            for (tile = 0; tile < ndev->cols; tile++)
+            {
+                memcpy(&ndev->vbuffer[bank * ndev->width + tile * LCD_WIDTH], &fw->data[(bank % LCD_BANKS) * LCD_WIDTH], LCD_WIDTH);
+            }
+        }
+    }
+    vbuffer_write_end(ndev);
+    mutex_unlock(&ndev->lock);
+
+    release_firmware(fw);
+}
+
+/********************************************************
+ *
+ * Brings up the panels of a surface: ends their reset
+ *  pulse, sends the init commands and the splash.  Runs
+ *  on nokia_wq so module load and probe do not wait for
+ *  the bus.  Opens wait until it is done.
+ *       
+ *********************************************************/
+static void bringup_worker(struct work_struct *work)
+{
+    struct nokia_device *ndev = container_of(work, struct nokia_device, bringup_work);
+    int state = NOKIA_STATE_READY;
+    int i;
+
+    splash_load(ndev);
+
+    // RST has been low since the panels were created, make sure the pulse was long enough
+    usleep_range(500, 1000);
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        struct nokia_panel *panel = ndev->panels[i];
+        int ret;
+
+        gpiod_set_value_cansleep(panel->rst, 1);
+
+        mutex_lock(&panel->bus_lock);
+        ret = lcd_init(panel);
+        mutex_unlock(&panel->bus_lock);
+
+        if (ret)
+        {
+            printk(KERN_ALERT "\033[31mCould not initialize LCD %d.\033[0m", panel->index);
+            state = NOKIA_STATE_FAILED;
+            break;
+        }
+
+        printk(KERN_INFO "\033[32mLCD %d Initialized.\033[0m", panel->index);
+    }
+
+    mutex_lock(&ndev->lock);
+    ndev->state = state;
+    // anything drawn meanwhile, e.g. through fbdev, was held back until now
+    if (state == NOKIA_STATE_READY)
+    {
+        schedule_flush(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+    wake_up_interruptible(&ndev->wait);
+}
+
+ /***************** Device Controls *****************/
+
+static int dev_open(struct inode *pinode, struct file *filep)
+{
+    struct nokia_device *ndev;
+    struct nokia_file *nfile;
+    struct device *dev;
+
+    // the surface is the drvdata of its class device, set before /dev/nokiaN appears
+    dev = class_find_device_by_devt(nokia.class, pinode->i_rdev);
+    if (!dev)
+    {
+        return -ENODEV;
+    }
+    ndev = dev_get_drvdata(dev);
+    put_device(dev);
+
+    // the panels are still being brought up, see bringup_worker()
+    if (READ_ONCE(ndev->state) == NOKIA_STATE_INIT)
+    {
+        if (filep->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ndev->wait, READ_ONCE(ndev->state) != NOKIA_STATE_INIT))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+    if (READ_ONCE(ndev->state) == NOKIA_STATE_FAILED)
+    {
+        return -EIO;
+    }
+
+    nfile = kzalloc(sizeof(*nfile), GFP_KERNEL);
+    if (!nfile)
+    {
+        return -ENOMEM;
+    }
+
+    nfile->ndev = ndev;
+    nfile->presented_seen = READ_ONCE(nfile->ndev->presented);
+    filep->private_data = nfile;
+
+    return 0;
+}
+
+static ssize_t dev_read(struct file *filep, char __user *buffer, size_t len, loff_t *offset)
+{
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+    size_t num_copy = len;
+    uint8_t *snapshot;
+    unsigned int seq;
+
+    if (*offset >= ndev->vbuffer_len || len == 0)
+    {
+        return 0;
+    }
+
+    num_copy = (ndev->vbuffer_len > len + *offset) ? len : ndev->vbuffer_len - *offset;
+
+    snapshot = kmalloc(num_copy, GFP_KERNEL);
+    if (!snapshot)
+    {
+        return -ENOMEM;
+    }
+
+    // readers never wait for writers, a copy torn by a write is taken again
+    do
+    {
+        seq = read_seqcount_begin(&ndev->seq);
+        memcpy(snapshot, ndev->vbuffer + *offset, num_copy);
+    } while (read_seqcount_retry(&ndev->seq, seq));
+
+    if (copy_to_user(buffer, snapshot, num_copy))
+    {
+        kfree(snapshot);
+        return -EFAULT;
+    }
+    kfree(snapshot);
+
+    *offset += num_copy;
+
+    return num_copy;
+}
+
+static ssize_t dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filep = iocb->ki_filp;
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+    struct nokia_layer *layer = READ_ONCE(nfile->layer);
+    size_t len = iov_iter_count(from);
+    size_t num_copy;
+    loff_t pos = iocb->ki_pos;
+    nokia_5110_mode mode = READ_ONCE(ndev->mode);
+    u32 format = READ_ONCE(ndev->format.format);
+    uint8_t wbuffer[LCD_WIDTH*LCD_BANKS];
+    bool front;
+    ssize_t ret;
+
+    // a layer only takes framebuffer bytes
+    if (layer)
+    {
+        mode = NOKIA_5110_MODE_GRPH;
+        format = NOKIA_5110_FMT_NATIVE;
+    }
+
+    trace_nokia_5110_write_start(ndev->index, len, mode);
+
+    if (mode == NOKIA_5110_MODE_GRPH && format == NOKIA_5110_FMT_REGIONS)
+    {
+        ret = regions_into_vbuffer(ndev, from, filep->f_flags & O_NONBLOCK);
+        goto out;
+    }
+    if (mode == NOKIA_5110_MODE_GRPH && (format == NOKIA_5110_FMT_RLE || format == NOKIA_5110_FMT_DELTA))
+    {
+        ret = decode_into_vbuffer(ndev, from, format, filep->f_flags & O_NONBLOCK);
+        goto out;
+    }
+    if (mode == NOKIA_5110_MODE_GRPH && (format == NOKIA_5110_FMT_FRM_GRAY8 || format == NOKIA_5110_FMT_FRM_GRAY2))
+    {
+        ret = planes_into_vbuffer(ndev, from, format);
+        goto out;
+    }
+    if (mode == NOKIA_5110_MODE_GRPH && format != NOKIA_5110_FMT_NATIVE)
+    {
+        ret = convert_into_vbuffer(ndev, from, filep->f_flags & O_NONBLOCK);
+        goto out;
+    }
+
+    if (len == 0)
+    {
+        ret = 0;
+        goto out;
+    }
+
+    if (mode == NOKIA_5110_MODE_GRPH)
+    {
+        // bytes land at the file position, so pwrite() addresses them directly
+        if (pos >= ndev->vbuffer_len)
+        {
+            ret = -ENOSPC;
+            goto out;
+        }
+        // larger surfaces take several writes per frame
+        num_copy = min_t(size_t, min_t(size_t, len, ndev->vbuffer_len - pos), sizeof(wbuffer));
+    }
+    else if (mode == NOKIA_5110_MODE_CHART)
+    {
+        num_copy = min(len, sizeof(wbuffer));
+    }
+    else
+    {
+        num_copy = min(len, cbuffer_len);
+    }
+
+    num_copy = copy_from_iter(wbuffer, num_copy, from);
+    if (!num_copy)
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    /* Only the framebuffer is touched here, the panel is updated by
+    the flush worker.  Drawing into a back buffer never waits, the flip
+    takes its place in the queue. */
+    mutex_lock(&ndev->lock);
+    // layers are composited straight into what the panels show
+    front = layer || ndev->draw == ndev->vbuffer;
+    if (front)
+    {
+        ret = queue_wait(ndev, filep->f_flags & O_NONBLOCK);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+    // the drawing helpers bracket their own framebuffer stores, layer bits are not read by dev_read()
+    if (layer)
+    {
+        memcpy(&layer->bits[pos], wbuffer, num_copy);
+        if (layer->visible)
+        {
+            mark_dirty(ndev, pos, num_copy);
+        }
+    }
+    else if (mode == NOKIA_5110_MODE_GRPH)
+    {
+        copy_into_vbuffer(ndev, pos, wbuffer, num_copy);
+    }
+    else if (mode == NOKIA_5110_MODE_CHART)
+    {
+        chart_write(ndev, wbuffer, num_copy);
+    }
+    else
+    {
+        lcd_char_write(ndev, wbuffer, num_copy);
+    }
+    if (front)
+    {
+        ndev->write_seq++;
+        schedule_flush(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+    if (mode == NOKIA_5110_MODE_GRPH)
+    {
+        // the position wraps at the end, so a stream of whole frames needs no seeks
+        iocb->ki_pos = (pos + num_copy < ndev->vbuffer_len) ? pos + num_copy : 0;
+    }
+
+    ret = num_copy;
+
+out:
+    trace_nokia_5110_write_end(ndev->index, ret);
+
+    return ret;
+}
+
+// Positions are framebuffer offsets, bank * width + x
+static loff_t dev_llseek(struct file *filep, loff_t offset, int whence)
+{
+    struct nokia_file *nfile = filep->private_data;
+
+    return fixed_size_llseek(filep, offset, whence, nfile->ndev->vbuffer_len);
+}
+
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
+{
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+    struct nokia_5110_range range;
+    struct nokia_5110_format format;
+    struct nokia_5110_chart chart;
+    u32 presented;
+
+    switch (cmd)
+    {
+    case NOKIA_5110_IOC_SET_MODE:
+        if (arg != NOKIA_5110_MODE_TEXT && arg != NOKIA_5110_MODE_GRPH && arg != NOKIA_5110_MODE_CHART)
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        ndev->mode = arg;
+        mutex_unlock(&ndev->lock);
+        if (arg != NOKIA_5110_MODE_GRPH)
+        {
+            planes_stop(ndev);
+        }
+        return 0;
+
+    case NOKIA_5110_IOC_FLUSH:
+        mutex_lock(&ndev->lock);
+        mark_dirty(ndev, 0, ndev->vbuffer_len);
+        schedule_flush(ndev);
+        mutex_unlock(&ndev->lock);
+        return 0;
+
+    case NOKIA_5110_IOC_FLUSH_RANGE:
+        if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+        {
+            return -EFAULT;
+        }
+        if (range.offset >= ndev->vbuffer_len || range.len > ndev->vbuffer_len - range.offset)
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        mark_dirty(ndev, range.offset, range.len);
+        schedule_flush(ndev);
+        mutex_unlock(&ndev->lock);
+        return 0;
+
+    case NOKIA_5110_IOC_SET_FORMAT:
+        if (copy_from_user(&format, (void __user *)arg, sizeof(format)))
+        {
+            return -EFAULT;
+        }
+        if (format.format > NOKIA_5110_FMT_FRM_GRAY2)
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        ndev->format = format;
+        mutex_unlock(&ndev->lock);
+        // the planes keep cycling until another format takes over
+        if (format.format != NOKIA_5110_FMT_FRM_GRAY8 && format.format != NOKIA_5110_FMT_FRM_GRAY2)
+        {
+            planes_stop(ndev);
+        }
+        return 0;
+
+    case NOKIA_5110_IOC_SET_FONT:
+        if (arg >= ARRAY_SIZE(fonts))
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        console_set_font(&ndev->console, arg);
+        mutex_unlock(&ndev->lock);
+        return 0;
+
+    case NOKIA_5110_IOC_PRESENTED:
+        presented = READ_ONCE(ndev->presented);
+        nfile->presented_seen = presented;
+        return put_user(presented, (__u32 __user *)arg);
+
+    case NOKIA_5110_IOC_SET_BUFFERING:
+        if (arg != NOKIA_5110_BUFFER_SINGLE && arg != NOKIA_5110_BUFFER_DOUBLE)
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        // the back buffer starts out as what is on screen
+        if (arg == NOKIA_5110_BUFFER_DOUBLE && ndev->draw != ndev->back)
+        {
+            memcpy(ndev->back, ndev->vbuffer, ndev->vbuffer_len);
+        }
+        ndev->draw = (arg == NOKIA_5110_BUFFER_DOUBLE) ? ndev->back : ndev->vbuffer;
+        mutex_unlock(&ndev->lock);
+        // the queue limit changed
+        wake_up_interruptible(&ndev->wait);
+        return 0;
+
+    case NOKIA_5110_IOC_FLIP:
+        if (arg & ~NOKIA_5110_FLIP_DROP)
+        {
+            return -EINVAL;
+        }
+        return nokia_flip(ndev, arg, filep->f_flags & O_NONBLOCK);
+
+    case NOKIA_5110_IOC_SET_SPRITE:
+        return sprite_set(ndev, (const struct nokia_5110_sprite __user *)arg);
+
+    case NOKIA_5110_IOC_BLIT:
+        return sprite_blits(ndev, (const struct nokia_5110_blits __user *)arg, filep->f_flags & O_NONBLOCK);
+
+    case NOKIA_5110_IOC_SET_LAYER:
+        return layer_set(nfile, (const struct nokia_5110_layer __user *)arg);
+
+    case NOKIA_5110_IOC_SET_CHART:
+        if (copy_from_user(&chart, (void __user *)arg, sizeof(chart)))
+        {
+            return -EFAULT;
+        }
+        if (chart.style > NOKIA_5110_CHART_BARS || (chart.flags & ~NOKIA_5110_CHART_WRAP))
+        {
+            return -EINVAL;
+        }
+        mutex_lock(&ndev->lock);
+        chart_reset(ndev, &chart);
+        mutex_unlock(&ndev->lock);
+        return 0;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+/********************************************************
+ *
+ * Maps the framebuffer page, then the back buffer page
+ *  Drawing through the first is made visible by a flush
+ *  ioctl or fsync(), through the second by a flip.
+ *       
+ *********************************************************/
+static int dev_mmap(struct file *filep, struct vm_area_struct *vma)
+{
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+    unsigned long pages = vma_pages(vma);
+    unsigned long i;
+    int ret;
+
+    if (vma->vm_pgoff >= 2 || pages > 2 - vma->vm_pgoff)
+    {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < pages; i++)
+    {
+        uint8_t *buffer = (vma->vm_pgoff + i == 0) ? ndev->vbuffer : ndev->back;
+
+        ret = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE, virt_to_page(buffer));
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+// Sends whatever changed in the mapped framebuffer and waits for it to reach the panel
+static int dev_fsync(struct file *filep, loff_t start, loff_t end, int datasync)
+{
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+
+    mutex_lock(&ndev->lock);
+    mark_dirty(ndev, 0, ndev->vbuffer_len);
+    mutex_unlock(&ndev->lock);
+
+    return flush_sync(ndev);
+}
+
+/********************************************************
+ *
+ * Reports what the file can do without blocking
+ *  The framebuffer is always readable, POLLOUT means the
+ *  update queue has room and POLLPRI that the panel was
+ *  refreshed since the last NOKIA_5110_IOC_PRESENTED.
+ *       
+ *********************************************************/
+static __poll_t dev_poll(struct file *filep, poll_table *wait)
+{
+    struct nokia_file *nfile = filep->private_data;
+    struct nokia_device *ndev = nfile->ndev;
+    __poll_t mask = EPOLLIN | EPOLLRDNORM;
+
+    poll_wait(filep, &ndev->wait, wait);
+
+    if (queue_has_room(ndev))
+    {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    if (READ_ONCE(ndev->presented) != nfile->presented_seen)
+    {
+        mask |= EPOLLPRI;
+    }
+
+    return mask;
+}
+
+// SIGIO is sent with POLL_OUT when queue space frees and POLL_PRI when a refresh completes
+static int dev_fasync(int fd, struct file *filep, int on)
+{
+    struct nokia_file *nfile = filep->private_data;
+
+    return fasync_helper(fd, filep, on, &nfile->ndev->fasync);
+}
+
+static int dev_release(struct inode *pinode, struct file *filep)
+{
+    dev_fasync(-1, filep, 0);
+    layer_remove(filep->private_data);
+    kfree(filep->private_data);
+
+    return 0;
+}
+
+ /***************** LCD Controls *****************/
+
+
+// Initializes the lcd, caller holds panel->bus_lock
+ static int lcd_init(struct nokia_panel *panel)
+{
+    struct nokia_device *ndev = panel->ndev;
+    // default startup settings
+    uint8_t init_commands[] = {LCD_COMMAND_FUNCT_SET | 0x01,
+                               LCD_COMMAND_Vop | 0x30,
+                               LCD_COMMAND_TEMP_CTRL,
+                               LCD_COMMAND_BIAS_SYS | nokiaBias,
+                               LCD_COMMAND_FUNCT_SET,
+                               LCD_COMMAND_DISP_CTRL | 0x04};
+    struct nokia_txn *txn = &panel->txn;
+    int bank;
+
+    pr_debug("nokia_5110: sending the init commands to LCD %d\n", panel->index);
+    txn_init(txn);
+    txn_commands(txn, init_commands, sizeof(init_commands));
+
+    // the panel RAM is undefined after reset so the panel's tile goes out whole
+    mutex_lock(&ndev->lock);
+    for (bank = 0; bank < LCD_BANKS; bank++)
+    {
+        memcpy(&panel->shadow[bank * LCD_WIDTH], &ndev->scanout[(panel->bank + bank) * ndev->width + panel->x], LCD_WIDTH);
+    }
+    mutex_unlock(&ndev->lock);
+
+    set_y(txn, 0);
+    set_x(txn, 0);
+    txn_data(txn, panel->shadow, panel_len);
+
+    return txn_submit(panel, txn);
+}
+
+// Records that len framebuffer bytes starting at offset changed, caller holds ndev->lock
+static void mark_dirty(struct nokia_device *ndev, size_t offset, size_t len)
+{
+    ktime_t now = 0;
+
+    // every change to what the panels show passes through here
+    if (ndev->scanout != ndev->vbuffer)
+    {
+        layers_composite(ndev, offset, len);
+    }
+
+    ndev->bytes_requested += len;
+
+    while (len)
+    {
+        int bank = offset / ndev->width;
+        int x = offset % ndev->width;
+        // split at tile edges, each piece goes to the panel showing it
+        int n = min_t(size_t, len, LCD_WIDTH - x % LCD_WIDTH);
+        struct nokia_panel *panel = ndev->panels[(bank / LCD_BANKS) * ndev->cols + x / LCD_WIDTH];
+        struct nokia_span *span = &panel->dirty[bank % LCD_BANKS];
+
+        x %= LCD_WIDTH;
+
+        // start of the write to visible latency, one clock read per pending flush
+        if (!panel->dirty_since)
+        {
+            now = now ? now : ktime_get();
+            panel->dirty_since = now;
+            panel->dirty_from = ndev->write_seq;
+        }
+
+        if (span->x0 >= span->x1)
+        {
+            span->x0 = x;
+            span->x1 = x + n;
+        }
+        else
+        {
+            span->x0 = min_t(int, span->x0, x);
+            span->x1 = max_t(int, span->x1, x + n);
+        }
+
+        offset += n;
+        len -= n;
+    }
+}
+
+/********************************************************
+ *
+ * Brackets a change to the framebuffer, so readers can
+ *  tell their copy was torn and take it again.  Readers
+ *  spin while a change is in progress, so the change is
+ *  kept short: only the stores go inside, marking dirty
+ *  and compositing layers come after.  The seqcount is
+ *  tied to ndev->lock, which the caller holds, and turns
+ *  off preemption for the change itself.
+ *       
+ *********************************************************/
+static void vbuffer_write_begin(struct nokia_device *ndev)
+{
+    write_seqcount_begin(&ndev->seq);
+}
+
+static void vbuffer_write_end(struct nokia_device *ndev)
+{
+    write_seqcount_end(&ndev->seq);
+}
+
+// Like mark_dirty() for the drawing paths, a back buffer only reaches the panels on a flip
+static void draw_dirty(struct nokia_device *ndev, size_t offset, size_t len)
+{
+    if (ndev->draw == ndev->vbuffer)
+    {
+        mark_dirty(ndev, offset, len);
+    }
+}
+
+/********************************************************
+ *
+ * Finds the bytes of a dirty span that differ from the
+ *  panel, as runs separated by at least NOKIA_SPLIT_GAP
+ *  unchanged bytes.  The last run allowed takes the rest.
+ *  params: 
+ *       vbuf, shadow - the bank in the framebuffer and in
+ *                      the panel RAM
+ *       x0, x1 - dirty span
+ *       runs - NOKIA_FLUSH_RUNS runs out
+ *  Returns the number of runs.
+ *       
+ *********************************************************/
+static int split_runs(const uint8_t *vbuf, const uint8_t *shadow, int x0, int x1, struct nokia_span *runs)
+{
+    int n = 0;
+    int x = x0;
+
+    while (x < x1)
+    {
+        int gap = 0;
+
+        while (x < x1 && vbuf[x] == shadow[x])
+        {
+            x++;
+        }
+        if (x == x1)
+        {
+            break;
+        }
+
+        runs[n].x0 = x;
+        for (; x < x1 && (gap < NOKIA_SPLIT_GAP || n == NOKIA_FLUSH_RUNS - 1); x++)
+        {
+            gap = (vbuf[x] == shadow[x]) ? gap + 1 : 0;
+        }
+        runs[n].x1 = x - gap;
+        n++;
+    }
+
+    return n;
+}
+
+/********************************************************
+ *
+ * Queues the runs of a refresh as one vertical addressing
+ *  burst when that sends fewer bytes.  The panel then
+ *  fills a column before moving on to the next, so the
+ *  burst covers the runs' bounding box, taken from the
+ *  frame.  The address wraps to bank 0 at the end of a
+ *  column, so a box wider than one column spans all the
+ *  banks.  Caller holds panel->bus_lock.
+ *  params: 
+ *       runs, nruns - runs of each bank, as found by
+ *                     split_runs() and already in the
+ *                     frame
+ *  Returns true when the burst was queued.
+ *       
+ *********************************************************/
+static bool flush_vertical(struct nokia_panel *panel, struct nokia_span runs[][NOKIA_FLUSH_RUNS], const int *nruns)
+{
+    struct nokia_txn *txn = &panel->txn;
+    int x0 = LCD_WIDTH, x1 = 0;
+    int b0 = LCD_BANKS, b1 = 0;
+    int horizontal = 0;
+    int bank, i, x;
+    int n = 0;
+
+    for (bank = 0; bank < LCD_BANKS; bank++)
+    {
+        if (!nruns[bank])
+        {
+            continue;
+        }
+
+        b0 = min(b0, bank);
+        b1 = bank + 1;
+        // a Y address per bank and an X address per run
+        horizontal += 1 + nruns[bank];
+        for (i = 0; i < nruns[bank]; i++)
+        {
+            x0 = min_t(int, x0, runs[bank][i].x0);
+            x1 = max_t(int, x1, runs[bank][i].x1);
+            horizontal += runs[bank][i].x1 - runs[bank][i].x0;
+        }
+    }
+
+    if (b0 >= b1)
+    {
+        return false;
+    }
+    if (x1 - x0 > 1)
+    {
+        b0 = 0;
+        b1 = LCD_BANKS;
+    }
+
+    // switching to vertical addressing and back, the two addresses and the box
+    if (4 + (x1 - x0) * (b1 - b0) >= horizontal)
+    {
+        return false;
+    }
+
+    for (x = x0; x < x1; x++)
+    {
+        for (bank = b0; bank < b1; bank++)
+        {
+            panel->columns[n++] = panel->frame[bank * LCD_WIDTH + x];
+        }
+    }
+
+    txn_command(txn, LCD_COMMAND_FUNCT_SET | LCD_COMMAND_FUNCT_VERT_ADDR);
+    set_y(txn, b0);
+    set_x(txn, x0);
+    txn_data(txn, panel->columns, n);
+    txn_command(txn, LCD_COMMAND_FUNCT_SET);
+
+    return true;
+}
+
+/********************************************************
+ *
+ * Sends the changed part of each dirty bank to the panel
+ *  Each span is compared with the shadow copy of the
+ *  panel RAM and split into runs of changed bytes, see
+ *  split_runs(), each of which becomes one addressed
+ *  burst.  All bursts go out as a single transaction.  All banks are
+ *  captured together, so the panel only ever shows whole
+ *  frames.  The shadow takes the runs once they are
+ *  sent, if the transfer fails they are dirty again and
+ *  the error is returned.  Caller holds panel->bus_lock.
+ *       
+ *********************************************************/
+static int lcd_flush(struct nokia_panel *panel)
+{
+    struct nokia_device *ndev = panel->ndev;
+    struct nokia_txn *txn = &panel->txn;
+    struct nokia_span runs[LCD_BANKS][NOKIA_FLUSH_RUNS];
+    int nruns[LCD_BANKS];
+    ktime_t since;
+    bool vertical;
+    bool room;
+    int bank, i;
+    int ret;
+
+    trace_nokia_5110_flush_start(panel->index);
+    txn_init(txn);
+
+    /* The whole tile is captured under one hold of the lock so a flip
+    or a write never reaches the panel half applied.  Writes landing
+    from here on start a new latency sample. */
+    mutex_lock(&ndev->lock);
+    since = panel->dirty_since;
+    panel->flushing = since != 0;
+    panel->flushing_from = panel->dirty_from;
+    panel->dirty_since = 0;
+
+    for (bank = 0; bank < LCD_BANKS; bank++)
+    {
+        uint8_t *frame = &panel->frame[bank * LCD_WIDTH];
+        const uint8_t *vbuf = &ndev->scanout[(panel->bank + bank) * ndev->width + panel->x];
+        nruns[bank] = split_runs(vbuf, &panel->shadow[bank * LCD_WIDTH], panel->dirty[bank].x0, panel->dirty[bank].x1, runs[bank]);
+        panel->dirty[bank].x0 = panel->dirty[bank].x1 = 0;
+
+        for (i = 0; i < nruns[bank]; i++)
+        {
+            memcpy(&frame[runs[bank][i].x0], &vbuf[runs[bank][i].x0], runs[bank][i].x1 - runs[bank][i].x0);
+        }
+    }
+    mutex_unlock(&ndev->lock);
+
+    // narrow updates spanning several banks go out column by column, the rest bank by bank
+    vertical = flush_vertical(panel, runs, nruns);
+    for (bank = 0; bank < LCD_BANKS && !vertical; bank++)
+    {
+        if (!nruns[bank])
+        {
+            continue;
+        }
+
+        set_y(txn, bank);
+        for (i = 0; i < nruns[bank]; i++)
+        {
+            set_x(txn, runs[bank][i].x0);
+            txn_data(txn, &panel->frame[bank * LCD_WIDTH + runs[bank][i].x0], runs[bank][i].x1 - runs[bank][i].x0);
+        }
+    }
+
+    ret = txn_submit(panel, txn);
+    trace_nokia_5110_flush_end(panel->index, txn->bytes, txn->nseg, ret);
+
+    if (!ret)
+    {
+        for (bank = 0; bank < LCD_BANKS; bank++)
+        {
+            for (i = 0; i < nruns[bank]; i++)
+            {
+                int x = bank * LCD_WIDTH + runs[bank][i].x0;
+
+                memcpy(&panel->shadow[x], &panel->frame[x], runs[bank][i].x1 - runs[bank][i].x0);
+            }
+        }
+
+        // addressing commands plus the data
+        panel->bytes_sent += txn->bytes;
+        if (txn->nseg)
+        {
+            panel->frames_flushed++;
+            if (since)
+            {
+                hist_add(&ndev->write_latency, ktime_to_ns(ktime_sub(ktime_get(), since)));
+            }
+        }
+    }
+
+    mutex_lock(&ndev->lock);
+    if (ret)
+    {
+        // the panel may hold any part of it, the runs stay dirty and go out again with the next flush
+        for (bank = 0; bank < LCD_BANKS; bank++)
+        {
+            struct nokia_span *span = &panel->dirty[bank];
+
+            if (!nruns[bank])
+            {
+                continue;
+            }
+
+            if (span->x0 >= span->x1)
+            {
+                span->x0 = runs[bank][0].x0;
+                span->x1 = runs[bank][nruns[bank] - 1].x1;
+            }
+            else
+            {
+                span->x0 = min_t(int, span->x0, runs[bank][0].x0);
+                span->x1 = max_t(int, span->x1, runs[bank][nruns[bank] - 1].x1);
+            }
+        }
+
+        // older than anything written meanwhile
+        if (since)
+        {
+            panel->dirty_since = since;
+            panel->dirty_from = panel->flushing_from;
+        }
+    }
+    panel->last_flush = ktime_get();
+    panel->flushing = false;
+    if (!ret && txn->nseg)
+    {
+        ndev->presented++;
+    }
+    room = queue_depth(ndev) < queue_limit(ndev);
+    mutex_unlock(&ndev->lock);
+
+    wake_up_interruptible(&ndev->wait);
+    if (room)
+    {
+        kill_fasync(&ndev->fasync, SIGIO, POLL_OUT);
+    }
+    if (!ret && txn->nseg)
+    {
+        kill_fasync(&ndev->fasync, SIGIO, POLL_PRI);
+    }
+
+    return ret;
+}
+
+/********************************************************
+ *
+ * Queues a flush of every panel with dirty spans, no
+ *  sooner than one frame interval after its previous
+ *  one.  A write landing while a flush is still pending
+ *  is coalesced into it.  Caller holds ndev->lock.
+ *       
+ *********************************************************/
+static void schedule_flush(struct nokia_device *ndev)
+{
+    bool coalesced = false;
+    int i, bank;
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        struct nokia_panel *panel = ndev->panels[i];
+        ktime_t due = ktime_add_ns(panel->last_flush, NSEC_PER_SEC / READ_ONCE(maxFps));
+        s64 wait_ns = ktime_to_ns(ktime_sub(due, ktime_get()));
+        unsigned long delay = (wait_ns > 0) ? nsecs_to_jiffies(wait_ns) : 0;
+
+        // tiles the write did not touch stay idle
+        for (bank = 0; bank < LCD_BANKS && panel->dirty[bank].x0 >= panel->dirty[bank].x1; bank++)
+        {
+        }
+        if (bank == LCD_BANKS)
+        {
+            continue;
+        }
+
+        if (!queue_delayed_work(nokia_wq, &panel->flush_work, delay))
+        {
+            coalesced = true;
+        }
+    }
+
+    if (coalesced)
+    {
+        ndev->writes_coalesced++;
+    }
+}
+
+static void flush_worker(struct work_struct *work)
+{
+    struct nokia_panel *panel = container_of(to_delayed_work(work), struct nokia_panel, flush_work);
+
+    // lcd_init() sends the whole tile once the panel is up
+    if (READ_ONCE(panel->ndev->state) != NOKIA_STATE_READY)
+    {
+        return;
+    }
+
+    mutex_lock(&panel->bus_lock);
+    WRITE_ONCE(panel->flush_error, lcd_flush(panel));
+    mutex_unlock(&panel->bus_lock);
+}
+
+// Runs a flush of every panel now, ignoring max_fps, waits for them to finish and returns the first error
+static int flush_sync(struct nokia_device *ndev)
+{
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        mod_delayed_work(nokia_wq, &ndev->panels[i]->flush_work, 0);
+    }
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        flush_delayed_work(&ndev->panels[i]->flush_work);
+        ret = ret ? ret : READ_ONCE(ndev->panels[i]->flush_error);
+    }
+
+    return ret;
+}
+
+/********************************************************
+ *
+ * Counts the writes not yet on the panel
+ *  Each write gets a sequence number.  A panel remembers
+ *  the oldest one among its dirty spans and among those
+ *  of the flush in progress, and everything from the
+ *  oldest of these over all panels on is still queued.
+ *  Caller holds ndev->lock, or can live with a stale
+ *  count.
+ *       
+ *********************************************************/
+static u32 queue_depth(struct nokia_device *ndev)
+{
+    u32 oldest = ndev->write_seq;
+    int i;
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        struct nokia_panel *panel = ndev->panels[i];
+
+        if (panel->flushing && (s32)(panel->flushing_from - oldest) < 0)
+        {
+            oldest = panel->flushing_from;
+        }
+        if (panel->dirty_since && (s32)(panel->dirty_from - oldest) < 0)
+        {
+            oldest = panel->dirty_from;
+        }
+    }
+
+    return ndev->write_seq - oldest;
+}
+
+// Updates let ahead of the panel, a double buffered surface only queues the frame being flipped
+static u32 queue_limit(struct nokia_device *ndev)
+{
+    return (ndev->draw == ndev->back) ? 1 : READ_ONCE(queueDepth);
+}
+
+/* Lockless, so it can be a wait condition.  A stale answer only
+costs a recheck, writers check again under the lock and every change
+that frees room is followed by a wake up. */
+static bool queue_has_room(struct nokia_device *ndev)
+{
+    return queue_depth(ndev) < queue_limit(ndev);
+}
+
+/********************************************************
+ *
+ * Holds a writer back while the queue is full
+ *  A flip waits for the previous frame to be picked up.
+ *  Called with ndev->lock held, returns 0
+ *  with it still held, or an error with it released.
+ *  params: 
+ *       nonblock - fail with -EAGAIN instead of waiting
+ *       
+ *********************************************************/
+static int queue_wait(struct nokia_device *ndev, bool nonblock)
+{
+    while (queue_depth(ndev) >= queue_limit(ndev))
+    {
+        mutex_unlock(&ndev->lock);
+
+        if (nonblock)
+        {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(ndev->wait, queue_has_room(ndev)))
+        {
+            return -ERESTARTSYS;
+        }
+
+        mutex_lock(&ndev->lock);
+    }
+
+    return 0;
+}
+
+/********************************************************
+ *
+ * Hands the back buffer to the panels as the next frame
+ *  The back buffer is copied rather than swapped, both
+ *  pages may be mapped into userspace.  The panels take
+ *  the frame in one piece, see lcd_flush().
+ *  params: 
+ *       flags - NOKIA_5110_FLIP_DROP to replace a frame
+ *               still waiting for the panels instead of
+ *               waiting for it to be picked up
+ *       nonblock - fail with -EAGAIN instead of waiting
+ *       
+ *********************************************************/
+static int nokia_flip(struct nokia_device *ndev, unsigned long flags, bool nonblock)
+{
+    int ret;
+    int i;
+
+    mutex_lock(&ndev->lock);
+    if (ndev->draw != ndev->back)
+    {
+        mutex_unlock(&ndev->lock);
+        return -EINVAL;
+    }
+
+    if (flags & NOKIA_5110_FLIP_DROP)
+    {
+        // a panel that has not picked up the last frame never shows it
+        for (i = 0; i < ndev->npanels; i++)
+        {
+            if (ndev->panels[i]->dirty_since)
+            {
+                ndev->frames_dropped++;
+                break;
+            }
+        }
+    }
+    else
+    {
+        ret = queue_wait(ndev, nonblock);
+        if (ret)
+        {
+            return ret;
+        }
+    }
+
+    vbuffer_write_begin(ndev);
+    memcpy(ndev->vbuffer, ndev->back, ndev->vbuffer_len);
+    vbuffer_write_end(ndev);
+    mark_dirty(ndev, 0, ndev->vbuffer_len);
+    ndev->write_seq++;
+    schedule_flush(ndev);
+    mutex_unlock(&ndev->lock);
+
+    return 0;
+}
+
+// Copies bytes into the framebuffer at offset, caller holds ndev->lock
+static void copy_into_vbuffer(struct nokia_device *ndev, size_t offset, const uint8_t *buffer_in, size_t len)
+{
+    vbuffer_write_begin(ndev);
+    memcpy(&ndev->draw[offset], buffer_in, len);
+    vbuffer_write_end(ndev);
+    draw_dirty(ndev, offset, len);
+}
+
+/********************************************************
+ *
+ * Applies a list of framebuffer regions as one update
+ *  Each region is a struct nokia_5110_range followed by
+ *  its bytes.  Up to NOKIA_5110_MAX_REGIONS regions and a
+ *  framebuffer's worth of bytes are taken, the rest is
+ *  left for the next write.
+ *  params: 
+ *       from - the regions, e.g. headers and bytes in
+ *              separate iovecs of one writev()
+ *       nonblock - fail with -EAGAIN when the queue is full
+ *       
+ *********************************************************/
+static ssize_t regions_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, bool nonblock)
+{
+    struct nokia_5110_range regions[NOKIA_5110_MAX_REGIONS];
+    uint8_t *data;
+    size_t data_len = 0;
+    size_t taken = 0;
+    bool front;
+    ssize_t ret;
+    int n = 0;
+    int i;
+
+    data = kmalloc(ndev->vbuffer_len, GFP_KERNEL);
+    if (!data)
+    {
+        return -ENOMEM;
+    }
+
+    while (n < NOKIA_5110_MAX_REGIONS && iov_iter_count(from) >= sizeof(regions[n]))
+    {
+        struct nokia_5110_range *region = &regions[n];
+
+        if (copy_from_iter(region, sizeof(*region), from) != sizeof(*region))
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+        if (region->offset >= ndev->vbuffer_len || region->len > ndev->vbuffer_len - region->offset ||
+            region->len > iov_iter_count(from))
+        {
+            ret = -EINVAL;
+            goto out;
+        }
+        if (region->len > ndev->vbuffer_len - data_len)
+        {
+            break;
+        }
+        if (copy_from_iter(&data[data_len], region->len, from) != region->len)
+        {
+            ret = -EFAULT;
+            goto out;
+        }
+
+        data_len += region->len;
+        taken += sizeof(*region) + region->len;
+        n++;
+    }
+
+    if (!n)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    // all regions go into the same refresh
+    mutex_lock(&ndev->lock);
+    front = ndev->draw == ndev->vbuffer;
+    if (front)
+    {
+        ret = queue_wait(ndev, nonblock);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+    for (i = 0, data_len = 0; i < n; i++)
+    {
+        copy_into_vbuffer(ndev, regions[i].offset, &data[data_len], regions[i].len);
+        data_len += regions[i].len;
+    }
+    if (front)
+    {
+        ndev->write_seq++;
+        schedule_flush(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+    ret = taken;
+
+out:
+    kfree(data);
+
+    return ret;
+}
+
+/********************************************************
+ *
+ * Unpacks a whole RLE or DELTA frame into the framebuffer
+ *  Only the bytes that change are marked dirty, so a
+ *  mostly static screen costs a few bytes on the bus too.
+ *  params: 
+ *       from - PackBits stream of one frame, see
+ *              nokia_5110_codec.h
+ *       format - NOKIA_5110_FMT_RLE for the frame itself,
+ *                NOKIA_5110_FMT_DELTA for its XOR with what
+ *                the framebuffer holds
+ *       nonblock - fail with -EAGAIN when the queue is full
+ *       
+ *********************************************************/
+static ssize_t decode_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, u32 format, bool nonblock)
+{
+    size_t len = iov_iter_count(from);
+    uint8_t *packed, *delta;
+    bool front;
+    ssize_t ret;
+    size_t x, n;
+
+    if (len == 0 || len > NOKIA_PACKBITS_BOUND(ndev->vbuffer_len))
+    {
+        return -EINVAL;
+    }
+
+    packed = kmalloc(len + ndev->vbuffer_len, GFP_KERNEL);
+    if (!packed)
+    {
+        return -ENOMEM;
+    }
+    delta = packed + len;
+
+    if (copy_from_iter(packed, len, from) != len)
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    if (nokia_packbits_decode(packed, len, delta, ndev->vbuffer_len) != ndev->vbuffer_len)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    mutex_lock(&ndev->lock);
+    front = ndev->draw == ndev->vbuffer;
+    if (front)
+    {
+        ret = queue_wait(ndev, nonblock);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+
+    // a whole frame is turned into its difference from the framebuffer
+    if (format == NOKIA_5110_FMT_RLE)
+    {
+        for (x = 0; x < ndev->vbuffer_len; x++)
+        {
+            delta[x] ^= ndev->draw[x];
+        }
+    }
+
+    for (x = 0; x < ndev->vbuffer_len; x += n)
+    {
+        if (!delta[x])
+        {
+            n = 1;
+            continue;
+        }
+        vbuffer_write_begin(ndev);
+        for (n = 0; x + n < ndev->vbuffer_len && delta[x + n]; n++)
+        {
+            ndev->draw[x + n] ^= delta[x + n];
+        }
+        vbuffer_write_end(ndev);
+        draw_dirty(ndev, x, n);
+    }
+    if (front)
+    {
+        ndev->write_seq++;
+        schedule_flush(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+    ret = len;
+
+out:
+    kfree(packed);
+
+    return ret;
+}
+
+/********************************************************
+ *
+ * Converts a whole frame in the selected graphics format
+ *  and replaces the framebuffer, or the back buffer when
+ *  double buffered, with it
+ *  params: 
+ *       from - user frame, MONO or GRAY8 layout, at least
+ *              one frame
+ *       nonblock - fail with -EAGAIN when the queue is full
+ *       
+ *********************************************************/
+static ssize_t convert_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, bool nonblock)
+{
+    size_t len = iov_iter_count(from);
+    const size_t stride = DIV_ROUND_UP(ndev->width, 8);
+    const size_t mono_len = stride * ndev->height;
+    struct nokia_5110_format format;
+    size_t frame_len;
+    uint8_t *frame, *mono, *native;
+    int ret;
+
+    mutex_lock(&ndev->lock);
+    format = ndev->format;
+    mutex_unlock(&ndev->lock);
+
+    frame_len = (format.format == NOKIA_5110_FMT_MONO) ? mono_len : ndev->width * ndev->height;
+    if (len < frame_len)
+    {
+        return -EINVAL;
+    }
+
+    // frame as written, then as 1-bpp rows, then in bank layout
+    frame = kmalloc(frame_len + mono_len + ndev->vbuffer_len, GFP_KERNEL);
+    if (!frame)
+    {
+        return -ENOMEM;
+    }
+    mono = frame + frame_len;
+    native = mono + mono_len;
+
+    if (copy_from_iter(frame, frame_len, from) != frame_len)
+    {
+        kfree(frame);
+        return -EFAULT;
+    }
+
+    if (format.format == NOKIA_5110_FMT_GRAY8)
+    {
+        nokia_gray_to_mono(frame, ndev->width, ndev->height, format.threshold, format.dither, mono, stride);
+    }
+    else
+    {
+        memcpy(mono, frame, mono_len);
+    }
+    nokia_mono_to_native(mono, stride, native, ndev->width, ndev->height);
+
+    mutex_lock(&ndev->lock);
+    if (ndev->draw == ndev->back)
+    {
+        // a back buffer frame is queued by the flip
+        memcpy(ndev->back, native, ndev->vbuffer_len);
+        mutex_unlock(&ndev->lock);
+        kfree(frame);
+        return frame_len;
+    }
+    ret = queue_wait(ndev, nonblock);
+    if (ret)
+    {
+        kfree(frame);
+        return ret;
+    }
+    vbuffer_write_begin(ndev);
+    memcpy(ndev->vbuffer, native, ndev->vbuffer_len);
+    vbuffer_write_end(ndev);
+    mark_dirty(ndev, 0, ndev->vbuffer_len);
+    ndev->write_seq++;
+    schedule_flush(ndev);
+    mutex_unlock(&ndev->lock);
+
+    kfree(frame);
+
+    return frame_len;
+}
+
+/********************************************************
+ *
+ * Feeds characters and escape sequences to the text console
+ *  params: 
+ *       buffer - ASCII character array
+ *       buffer_len - number of bytes in buffer    
+ *  Caller holds ndev->lock.
+ *       
+ *********************************************************/
+static int lcd_char_write(struct nokia_device *ndev, uint8_t *buffer, size_t buffer_len)
+{
+    struct nokia_console *con = &ndev->console;
+
+    while (buffer_len)
+    {
+        uint8_t c = *buffer;
+
+        switch (con->state)
+        {
+        case CONSOLE_ESC:
+            con->state = CONSOLE_NORMAL;
+            if (c == '[')
+            {
+                memset(con->params, 0, sizeof(con->params));
+                con->nparams = 0;
+                con->state = CONSOLE_CSI;
+            }
+            else if (c == 'c')
+            {
+                console_reset(con);
+            }
+            break;
+
+        case CONSOLE_CSI:
+            if (c >= '0' && c <= '9')
+            {
+                int *param;
+
+                con->nparams = max(con->nparams, 1);
+                param = &con->params[con->nparams - 1];
+                *param = min(*param * 10 + (c - '0'), 999);
+            }
+            else if (c == ';')
+            {
+                con->nparams = min(max(con->nparams, 1) + 1, NOKIA_CSI_PARAMS);
+            }
+            else if (c >= 0x40 && c <= 0x7E)
+            {
+                console_csi(con, c);
+                con->state = CONSOLE_NORMAL;
+            }
+            break;
+
+        default:
+            if (c == 0x1B)
+            {
+                con->state = CONSOLE_ESC;
+            }
+            else if (c == '\r')
+            {
+                con->col = 0;
+            }
+            else if (c == '\n')
+            {
+                // LF also returns the carriage, like a tty with ONLCR
+                console_newline(con);
+            }
+            else if (c == '\b')
+            {
+                con->col = max(con->col - 1, 0);
+            }
+            else if (c == '\t')
+            {
+                con->col = min((con->col / 8 + 1) * 8, console_cols(con));
+            }
+            else if (c == '\f')
+            {
+                console_clear(con);
+            }
+            else if (c >= 0x20 && c < 0x7F)
+            {
+                console_putc(con, c);
+            }
+            // any other byte is dropped, a client writing binary must not flood the log
+            break;
+        }
+
+        buffer++;
+        buffer_len--;
+    }
+
+    return 0;
+}
+
+ /***************** Text Console *****************/
+
+static int console_cols(const struct nokia_console *con)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+
+    return ndev->width / fonts[con->font].advance;
+}
+
+static int console_rows(const struct nokia_console *con)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+
+    return ndev->height / fonts[con->font].line_height;
+}
+
+// Switches font, keeping the cursor at about the same place on screen
+static void console_set_font(struct nokia_console *con, unsigned int font)
+{
+    int x = con->col * fonts[con->font].advance;
+    int y = con->row * fonts[con->font].line_height;
+
+    con->font = font;
+    con->col = min(x / fonts[font].advance, console_cols(con));
+    con->row = min(y / fonts[font].line_height, console_rows(con) - 1);
+}
+
+// Draws a character at the cursor, wrapping to the next line first if the row is full
+static void console_putc(struct nokia_console *con, uint8_t c)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+    const struct nokia_font *font = &fonts[con->font];
+
+    if (con->col >= console_cols(con))
+    {
+        console_newline(con);
+    }
+
+    render_glyph(ndev, font, c - 0x20, con->col * font->advance, con->row * font->line_height, con->inverse);
+    con->col++;
+}
+
+/********************************************************
+ *
+ * Moves the whole screen up by a number of pixel rows
+ *  The PCD8544 has no hardware scroll, so the framebuffer
+ *  is shifted and the flush sends the banks whose bytes
+ *  actually changed.  Bank aligned distances move whole
+ *  banks, others merge each byte with the one below it,
+ *  working down so every source is read before it is
+ *  overwritten.
+ *       
+ *********************************************************/
+static void console_scroll(struct nokia_console *con, int pixels)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+    uint8_t *vbuffer = ndev->draw;
+    const int width = ndev->width;
+    const int skip = min(pixels / 8, ndev->banks);
+    const int shift = pixels % 8;
+    int x, bank;
+
+    vbuffer_write_begin(ndev);
+    if (shift == 0)
+    {
+        memmove(vbuffer, &vbuffer[skip * width], (ndev->banks - skip) * width);
+    }
+    else
+    {
+        for (bank = 0; bank + skip < ndev->banks; bank++)
+        {
+            const uint8_t *lo = &vbuffer[(bank + skip) * width];
+            const uint8_t *hi = (bank + skip + 1 < ndev->banks) ? lo + width : NULL;
+            uint8_t *out = &vbuffer[bank * width];
+
+            // LSB is the top row, so moving up is a right shift
+            for (x = 0; x < width; x++)
+            {
+                out[x] = lo[x] >> shift | (hi ? hi[x] << (8 - shift) : 0);
+            }
+        }
+    }
+    memset(&vbuffer[(ndev->banks - skip) * width], 0, skip * width);
+    vbuffer_write_end(ndev);
+
+    draw_dirty(ndev, 0, ndev->vbuffer_len);
+}
+
+static void console_newline(struct nokia_console *con)
+{
+    con->col = 0;
+    con->row++;
+
+    if (con->row >= console_rows(con))
+    {
+        console_scroll(con, fonts[con->font].line_height);
+        con->row = console_rows(con) - 1;
+    }
+}
+
+// Blanks cells [col0, col1) of a row
+static void console_erase(struct nokia_console *con, int row, int col0, int col1)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+    const struct nokia_font *font = &fonts[con->font];
+    int col;
+
+    for (col = col0; col < col1; col++)
+    {
+        render_glyph(ndev, font, 0, col * font->advance, row * font->line_height, false);
+    }
+}
+
+static void console_clear(struct nokia_console *con)
+{
+    struct nokia_device *ndev = container_of(con, struct nokia_device, console);
+
+    vbuffer_write_begin(ndev);
+    memset(ndev->draw, 0, ndev->vbuffer_len);
+    vbuffer_write_end(ndev);
+    draw_dirty(ndev, 0, ndev->vbuffer_len);
+
+    con->col = 0;
+    con->row = 0;
+}
+
+static void console_reset(struct nokia_console *con)
+{
+    console_clear(con);
+    con->inverse = false;
+}
+
+// Select Graphic Rendition: 0 plain, 7/27 inverse on/off, 10-13 font
+static void console_sgr(struct nokia_console *con, int param)
+{
+    if (param == 0 || param == 27)
+    {
+        con->inverse = false;
+    }
+    else if (param == 7)
+    {
+        con->inverse = true;
+    }
+    else if (param >= 10 && param < 10 + ARRAY_SIZE(fonts))
+    {
+        console_set_font(con, param - 10);
+    }
+}
+
+// Runs a complete CSI sequence ending in final
+static void console_csi(struct nokia_console *con, uint8_t final)
+{
+    const int cols = console_cols(con);
+    const int rows = console_rows(con);
+    const int count = max(con->params[0], 1);
+    int i;
+
+    switch (final)
+    {
+    case 'A':
+        con->row = max(con->row - count, 0);
+        break;
+
+    case 'B':
+        con->row = min(con->row + count, rows - 1);
+        break;
+
+    case 'C':
+        con->col = min(con->col + count, cols - 1);
+        break;
+
+    case 'D':
+        con->col = max(min(con->col, cols - 1) - count, 0);
+        break;
+
+    case 'H':
+    case 'f':
+        // 1-based row;column
+        con->row = clamp(con->params[0], 1, rows) - 1;
+        con->col = clamp(con->params[1], 1, cols) - 1;
+        break;
+
+    case 'J':
+        if (con->params[0] == 2)
+        {
+            int col = con->col;
+            int row = con->row;
+
+            console_clear(con);
+            con->col = col;
+            con->row = row;
+        }
+        else if (con->params[0] == 1)
+        {
+            // from the top of the screen through the cursor
+            for (i = 0; i < con->row; i++)
+            {
+                console_erase(con, i, 0, cols);
+            }
+            console_erase(con, con->row, 0, min(con->col + 1, cols));
+        }
+        else
+        {
+            console_erase(con, con->row, con->col, cols);
+            for (i = con->row + 1; i < rows; i++)
+            {
+                console_erase(con, i, 0, cols);
+            }
+        }
+        break;
+
+    case 'K':
+        if (con->params[0] == 2)
+        {
+            console_erase(con, con->row, 0, cols);
+        }
+        else if (con->params[0] == 1)
+        {
+            console_erase(con, con->row, 0, min(con->col + 1, cols));
+        }
+        else
+        {
+            console_erase(con, con->row, con->col, cols);
+        }
+        break;
+
+    case 'm':
+        console_sgr(con, con->params[0]);
+        for (i = 1; i < con->nparams; i++)
+        {
+            console_sgr(con, con->params[i]);
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+ /***************** Fonts *****************/
+
+// Spreads each bit of a column byte over two rows
+static u32 font_double_bits(uint8_t bits)
+{
+    u32 out = 0;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        if (bits & (1 << i))
+        {
+            out |= 3 << (2 * i);
+        }
+    }
+
+    return out;
+}
+
+// Pre-renders every glyph of every font at each of the 8 y offsets within a bank
+static int font_cache_init(void)
+{
+    int f, g, c, shift;
+
+    for (f = 0; f < ARRAY_SIZE(fonts); f++)
+    {
+        struct nokia_font *font = &fonts[f];
+        const u32 cell = (1U << font->line_height) - 1;
+        const u32 glyph = (1U << (font->height * font->scale)) - 1;
+
+        font->cache = vmalloc(NOKIA_FONT_GLYPHS * 8 * font->advance * sizeof(u32));
+        if (!font->cache)
+        {
+            font_cache_exit();
+            return -ENOMEM;
+        }
+
+        for (g = 0; g < NOKIA_FONT_GLYPHS; g++)
+        {
+            for (c = 0; c < font->advance; c++)
+            {
+                u32 bits = 0;
+
+                // columns past the scaled glyph are the inter-character spacing
+                if (c < font->width * font->scale)
+                {
+                    uint8_t src = font->glyphs[g * font->width + c / font->scale];
+
+                    bits = (font->scale == 2) ? font_double_bits(src) : src;
+                }
+
+                for (shift = 0; shift < 8; shift++)
+                {
+                    font->cache[(g * 8 + shift) * font->advance + c] = (bits & glyph) << shift;
+                }
+            }
+        }
+
+        for (shift = 0; shift < 8; shift++)
+        {
+            font->mask[shift] = cell << shift;
+        }
+    }
+
+    return 0;
+}
+
+static void font_cache_exit(void)
+{
+    int f;
+
+    for (f = 0; f < ARRAY_SIZE(fonts); f++)
+    {
+        vfree(fonts[f].cache);
+        fonts[f].cache = NULL;
+    }
+}
+
+/********************************************************
+ *
+ * Draws one glyph cell into the framebuffer, glyph pixels
+ *  black and the rest of the cell white
+ *  params: 
+ *       font - font to draw with
+ *       index - glyph, character code - 0x20
+ *       x - left column of the cell
+ *       y - top row of the cell, need not be bank aligned
+ *       inverse - draw white on black instead
+ *  Caller holds ndev->lock.
+ *       
+ *********************************************************/
+static void render_glyph(struct nokia_device *ndev, const struct nokia_font *font, uint8_t index, int x, int y, bool inverse)
+{
+    const u32 *cols = &font->cache[(index * 8 + y % 8) * font->advance];
+    const u32 mask = font->mask[y % 8];
+    int width = min(font->advance, ndev->width - x);
+    int last_bank = min((y + font->line_height - 1) / 8, ndev->banks - 1);
+    int bank, c;
+
+    for (bank = y / 8; bank <= last_bank; bank++)
+    {
+        const int shift = 8 * (bank - y / 8);
+        const uint8_t bank_mask = mask >> shift;
+        const uint8_t flip = inverse ? bank_mask : 0;
+        uint8_t *out = &ndev->draw[bank * ndev->width + x];
+
+        vbuffer_write_begin(ndev);
+        for (c = 0; c < width; c++)
+        {
+            out[c] = (out[c] & ~bank_mask) | ((uint8_t)(cols[c] >> shift) ^ flip);
+        }
+        vbuffer_write_end(ndev);
+
+        draw_dirty(ndev, bank * ndev->width + x, width);
+    }
+}
+
+
+
+ /***************** Gray Planes *****************/
+
+/********************************************************
+ *
+ * Takes a frame of a NOKIA_5110_FMT_FRM_ format
+ *  The frame is quantized to 4 levels and split into
+ *  NOKIA_GRAY_PLANES bit-planes, which replace those of
+ *  the previous frame.  The plane timer starts with the
+ *  first frame, so the write never waits for the panels.
+ *  params: 
+ *       from - the frame, anything past it is ignored
+ *       format - NOKIA_5110_FMT_FRM_GRAY8 or _GRAY2
+ *       
+ *********************************************************/
+static ssize_t planes_into_vbuffer(struct nokia_device *ndev, struct iov_iter *from, u32 format)
+{
+    size_t len = iov_iter_count(from);
+    const size_t stride = DIV_ROUND_UP(ndev->width, 8);
+    const size_t mono_len = stride * ndev->height;
+    const size_t gray_len = ndev->width * ndev->height;
+    const size_t planes_len = NOKIA_GRAY_PLANES * ndev->vbuffer_len;
+    size_t frame_len;
+    uint8_t *frame, *gray, *mono, *planes;
+    int i;
+
+    frame_len = (format == NOKIA_5110_FMT_FRM_GRAY2) ? DIV_ROUND_UP(ndev->width, 4) * ndev->height : gray_len;
+    if (len < frame_len)
+    {
+        return -EINVAL;
+    }
+
+    // frame as written, then as 8-bpp, then one plane at a time as 1-bpp rows
+    frame = kmalloc(frame_len + gray_len + mono_len, GFP_KERNEL);
+    planes = kmalloc(planes_len, GFP_KERNEL);
+    if (!frame || !planes)
+    {
+        kfree(frame);
+        kfree(planes);
+        return -ENOMEM;
+    }
+    gray = frame + frame_len;
+    mono = gray + gray_len;
+
+    if (copy_from_iter(frame, frame_len, from) != frame_len)
+    {
+        kfree(frame);
+        kfree(planes);
+        return -EFAULT;
+    }
+
+    if (format == NOKIA_5110_FMT_FRM_GRAY2)
+    {
+        nokia_gray2_to_gray8(frame, ndev->width, ndev->height, gray);
+    }
+    else
+    {
+        memcpy(gray, frame, gray_len);
+    }
+
+    // plane i is black below (3 - i) quarters of full scale, so darker levels are black in more planes
+    for (i = 0; i < NOKIA_GRAY_PLANES; i++)
+    {
+        nokia_gray_to_mono(gray, ndev->width, ndev->height, (NOKIA_GRAY_PLANES - i) * 64, 0, mono, stride);
+        nokia_mono_to_native(mono, stride, &planes[i * ndev->vbuffer_len], ndev->width, ndev->height);
+    }
+
+    mutex_lock(&ndev->lock);
+    if (!ndev->planes)
+    {
+        ndev->planes = planes;
+        planes = NULL;
+    }
+    else
+    {
+        memcpy(ndev->planes, planes, planes_len);
+    }
+    planes_start(ndev);
+    mutex_unlock(&ndev->lock);
+
+    kfree(planes);
+    kfree(frame);
+
+    return frame_len;
+}
+
+// Starts the plane cycle unless it is running, caller holds ndev->lock
+static void planes_start(struct nokia_device *ndev)
+{
+    if (!hrtimer_active(&ndev->plane_timer))
+    {
+        ndev->plane_window = ktime_get();
+        ndev->plane_window_shown = ndev->planes_shown;
+        hrtimer_start(&ndev->plane_timer, ns_to_ktime(NSEC_PER_SEC / READ_ONCE(planeHz)), HRTIMER_MODE_REL);
+    }
+}
+
+/* Stops the plane cycle and frees the planes, the framebuffer keeps
+the last plane shown.  The work takes ndev->lock, so it is cancelled
+with the lock dropped.  A frame racing in meanwhile found the timer
+still active and left it alone, so the cycle is restarted for it. */
+static void planes_stop(struct nokia_device *ndev)
+{
+    uint8_t *planes;
+
+    mutex_lock(&ndev->lock);
+    planes = ndev->planes;
+    ndev->planes = NULL;
+    mutex_unlock(&ndev->lock);
+
+    hrtimer_cancel(&ndev->plane_timer);
+    cancel_work_sync(&ndev->plane_work);
+
+    mutex_lock(&ndev->lock);
+    if (ndev->planes)
+    {
+        planes_start(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+    kfree(planes);
+}
+
+/* Runs in interrupt context, so the plane is swapped in by
+plane_work.  Periods the timer overran count as ticks too. */
+static enum hrtimer_restart plane_timer_fn(struct hrtimer *timer)
+{
+    struct nokia_device *ndev = container_of(timer, struct nokia_device, plane_timer);
+
+    atomic_add(hrtimer_forward_now(timer, ns_to_ktime(NSEC_PER_SEC / READ_ONCE(planeHz))), &ndev->plane_ticks);
+    queue_work(nokia_wq, &ndev->plane_work);
+
+    return HRTIMER_RESTART;
+}
+
+/********************************************************
+ *
+ * Puts the next plane into the framebuffer and flushes
+ *  it at once, bypassing max_fps.  The flush only sends
+ *  the bytes that differ from the plane before.  While a
+ *  panel is still busy with that one the period is
+ *  missed and the plane stays up for another period.
+ *
+ *********************************************************/
+static void plane_worker(struct work_struct *work)
+{
+    struct nokia_device *ndev = container_of(work, struct nokia_device, plane_work);
+    int ticks = atomic_xchg(&ndev->plane_ticks, 0);
+    ktime_t now;
+    s64 elapsed;
+    int i;
+
+    mutex_lock(&ndev->lock);
+    if (!ndev->planes)
+    {
+        mutex_unlock(&ndev->lock);
+        return;
+    }
+
+    // periods that passed before the work got to run
+    if (ticks > 1)
+    {
+        ndev->planes_missed += ticks - 1;
+    }
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        if (ndev->panels[i]->dirty_since || ndev->panels[i]->flushing)
+        {
+            break;
+        }
+    }
+    if (i < ndev->npanels)
+    {
+        ndev->planes_missed++;
+        mutex_unlock(&ndev->lock);
+        return;
+    }
+
+    ndev->plane = (ndev->plane + 1) % NOKIA_GRAY_PLANES;
+    vbuffer_write_begin(ndev);
+    memcpy(ndev->vbuffer, &ndev->planes[ndev->plane * ndev->vbuffer_len], ndev->vbuffer_len);
+    vbuffer_write_end(ndev);
+    mark_dirty(ndev, 0, ndev->vbuffer_len);
+    ndev->planes_shown++;
+
+    now = ktime_get();
+    elapsed = ktime_to_ns(ktime_sub(now, ndev->plane_window));
+    if (elapsed >= NSEC_PER_SEC)
+    {
+        ndev->plane_rate = div64_u64((ndev->planes_shown - ndev->plane_window_shown) * NSEC_PER_SEC, elapsed);
+        ndev->plane_window = now;
+        ndev->plane_window_shown = ndev->planes_shown;
+    }
+    mutex_unlock(&ndev->lock);
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        mod_delayed_work(nokia_wq, &ndev->panels[i]->flush_work, 0);
+    }
+}
+
+ /***************** Strip Chart *****************/
+
+// Restarts the chart at the left edge, caller holds ndev->lock
+static void chart_reset(struct nokia_device *ndev, const struct nokia_5110_chart *chart)
+{
+    ndev->chart = *chart;
+    ndev->chart_x = 0;
+    ndev->chart_last = -1;
+}
+
+/********************************************************
+ *
+ * Plots samples as columns of the chart
+ *  A scrolling chart shifts the surface left one column
+ *  per sample, so most of it is resent.  A wrapping chart
+ *  only changes the new sample's column and the blank
+ *  cursor column after it, which the flush sends as one
+ *  vertical burst.  Caller holds ndev->lock.
+ *  params: 
+ *       samples - one byte per sample, 0 is the bottom row
+ *       len - number of samples
+ *       
+ *********************************************************/
+static void chart_write(struct nokia_device *ndev, const uint8_t *samples, size_t len)
+{
+    const bool wrap = ndev->chart.flags & NOKIA_5110_CHART_WRAP;
+    int bank, x, y;
+    int top, bottom;
+
+    for (; len; samples++, len--)
+    {
+        y = (ndev->height - 1) - *samples * (ndev->height - 1) / 255;
+
+        if (wrap)
+        {
+            x = ndev->chart_x;
+            ndev->chart_x = (x + 1) % ndev->width;
+            // no line back from the right edge
+            if (x == 0)
+            {
+                ndev->chart_last = -1;
+            }
+        }
+        else
+        {
+            x = ndev->width - 1;
+            for (bank = 0; bank < ndev->banks; bank++)
+            {
+                vbuffer_write_begin(ndev);
+                memmove(&ndev->draw[bank * ndev->width], &ndev->draw[bank * ndev->width + 1], ndev->width - 1);
+                vbuffer_write_end(ndev);
+                draw_dirty(ndev, bank * ndev->width, ndev->width - 1);
+            }
+        }
+
+        top = bottom = y;
+        if (ndev->chart.style == NOKIA_5110_CHART_BARS)
+        {
+            bottom = ndev->height - 1;
+        }
+        else if (ndev->chart_last >= 0)
+        {
+            top = min(y, ndev->chart_last);
+            bottom = max(y, ndev->chart_last);
+        }
+        chart_column(ndev, x, top, bottom);
+        ndev->chart_last = y;
+
+        if (wrap)
+        {
+            chart_column(ndev, ndev->chart_x, 0, -1);
+        }
+    }
+}
+
+// Draws rows [top, bottom] of a column black and the rest white, caller holds ndev->lock
+static void chart_column(struct nokia_device *ndev, int x, int top, int bottom)
+{
+    int bank;
+
+    for (bank = 0; bank < ndev->banks; bank++)
+    {
+        int y0 = max(top, bank * 8);
+        int y1 = min(bottom, bank * 8 + 7);
+        uint8_t bits = 0;
+
+        if (y0 <= y1)
+        {
+            bits = (0xff >> (7 - (y1 - y0))) << (y0 - bank * 8);
+        }
+        vbuffer_write_begin(ndev);
+        ndev->draw[bank * ndev->width + x] = bits;
+        vbuffer_write_end(ndev);
+        draw_dirty(ndev, bank * ndev->width + x, 1);
+    }
+}
+
+ /***************** Layers *****************/
+
+/********************************************************
+ *
+ * Makes a file a layer, or updates its layer
+ *  The first layer of a surface gives it a scanout
+ *  buffer of its own.  What the layer covered before and
+ *  covers now is composited again and refreshed.
+ *  params: 
+ *       nfile - the file, its layer starts out blank
+ *       arg - window, z and flags
+ *       
+ *********************************************************/
+static int layer_set(struct nokia_file *nfile, const struct nokia_5110_layer __user *arg)
+{
+    struct nokia_device *ndev = nfile->ndev;
+    struct nokia_5110_layer req;
+    struct nokia_layer *layer = NULL;
+    struct nokia_layer *pos;
+    uint8_t *scanout = NULL;
+    int x0, y0, x1, y1;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+    if (req.flags & ~NOKIA_5110_LAYER_VISIBLE)
+    {
+        return -EINVAL;
+    }
+
+    // allocated up front, the lock is not held across allocations
+    if (!READ_ONCE(nfile->layer))
+    {
+        layer = kzalloc(sizeof(*layer) + ndev->vbuffer_len, GFP_KERNEL);
+        scanout = kmalloc(ndev->vbuffer_len, GFP_KERNEL);
+        if (!layer || !scanout)
+        {
+            kfree(layer);
+            kfree(scanout);
+            return -ENOMEM;
+        }
+    }
+
+    mutex_lock(&ndev->lock);
+    if (!nfile->layer && layer)
+    {
+        if (ndev->scanout == ndev->vbuffer)
+        {
+            memcpy(scanout, ndev->vbuffer, ndev->vbuffer_len);
+            ndev->scanout = scanout;
+            scanout = NULL;
+        }
+        nfile->layer = layer;
+        layer = NULL;
+        x0 = y0 = x1 = y1 = 0;
+    }
+    else
+    {
+        // the window it leaves
+        x0 = nfile->layer->x0;
+        y0 = nfile->layer->y0;
+        x1 = nfile->layer->x1;
+        y1 = nfile->layer->y1;
+        list_del(&nfile->layer->node);
+    }
+
+    nfile->layer->x0 = clamp_t(int, req.x, 0, ndev->width);
+    nfile->layer->y0 = clamp_t(int, req.y, 0, ndev->height);
+    nfile->layer->x1 = clamp_t(int, req.x + req.width, nfile->layer->x0, ndev->width);
+    nfile->layer->y1 = clamp_t(int, req.y + req.height, nfile->layer->y0, ndev->height);
+    nfile->layer->z = req.z;
+    nfile->layer->visible = req.flags & NOKIA_5110_LAYER_VISIBLE;
+
+    // above every layer with the same z or a lower one
+    list_for_each_entry(pos, &ndev->layers, node)
+    {
+        if (pos->z > nfile->layer->z)
+        {
+            break;
+        }
+    }
+    list_add_tail(&nfile->layer->node, &pos->node);
+
+    layer_mark(ndev, x0, y0, x1, y1);
+    layer_mark(ndev, nfile->layer->x0, nfile->layer->y0, nfile->layer->x1, nfile->layer->y1);
+    schedule_flush(ndev);
+    mutex_unlock(&ndev->lock);
+
+    // lost a race with another SET_LAYER on the same file
+    kfree(layer);
+    kfree(scanout);
+
+    return 0;
+}
+
+// Drops a closing file's layer, the last one takes the scanout buffer with it
+static void layer_remove(struct nokia_file *nfile)
+{
+    struct nokia_device *ndev = nfile->ndev;
+    struct nokia_layer *layer = nfile->layer;
+    uint8_t *scanout = NULL;
+
+    if (!layer)
+    {
+        return;
+    }
+
+    mutex_lock(&ndev->lock);
+    list_del(&layer->node);
+    nfile->layer = NULL;
+    if (list_empty(&ndev->layers))
+    {
+        // the panels hold on to what they show until the flush diffs it against vbuffer
+        scanout = ndev->scanout;
+        ndev->scanout = ndev->vbuffer;
+        mark_dirty(ndev, 0, ndev->vbuffer_len);
+    }
+    else
+    {
+        layer_mark(ndev, layer->x0, layer->y0, layer->x1, layer->y1);
+    }
+    schedule_flush(ndev);
+    mutex_unlock(&ndev->lock);
+
+    kfree(scanout);
+    kfree(layer);
+}
+
+// Composites and refreshes the banks of a window, caller holds ndev->lock
+static void layer_mark(struct nokia_device *ndev, int x0, int y0, int x1, int y1)
+{
+    int bank;
+
+    if (x0 >= x1 || y0 >= y1)
+    {
+        return;
+    }
+
+    for (bank = y0 / 8; bank <= (y1 - 1) / 8; bank++)
+    {
+        mark_dirty(ndev, bank * ndev->width + x0, x1 - x0);
+    }
+}
+
+/********************************************************
+ *
+ * Rebuilds a byte range of the scanout buffer from the
+ *  framebuffer and the visible layers, bottom to top.
+ *  Within its window a layer replaces what is beneath.
+ *  Caller holds ndev->lock.
+ *       
+ *********************************************************/
+static void layers_composite(struct nokia_device *ndev, size_t offset, size_t len)
+{
+    struct nokia_layer *layer;
+    const size_t end = offset + len;
+
+    memcpy(&ndev->scanout[offset], &ndev->vbuffer[offset], len);
+
+    list_for_each_entry(layer, &ndev->layers, node)
+    {
+        int bank;
+
+        if (!layer->visible)
+        {
+            continue;
+        }
+
+        for (bank = offset / ndev->width; bank * ndev->width < end; bank++)
+        {
+            // rows of the window within the bank, and its columns within the range
+            int r0 = max(layer->y0, bank * 8) - bank * 8;
+            int r1 = min(layer->y1, bank * 8 + 8) - bank * 8;
+            size_t i = max_t(size_t, offset, bank * ndev->width + layer->x0);
+            size_t i1 = min_t(size_t, end, bank * ndev->width + layer->x1);
+            uint8_t mask;
+
+            if (r0 >= r1)
+            {
+                continue;
+            }
+            mask = (0xff >> (8 - (r1 - r0))) << r0;
+
+            for (; i < i1; i++)
+            {
+                ndev->scanout[i] = (ndev->scanout[i] & ~mask) | (layer->bits[i] & mask);
+            }
+        }
+    }
+}
+
+ /***************** Sprites *****************/
+
+// Uploads a bitmap into a slot, an empty one frees it
+static int sprite_set(struct nokia_device *ndev, const struct nokia_5110_sprite __user *arg)
+{
+    struct nokia_5110_sprite req;
+    struct nokia_sprite *sprite = NULL;
+    struct nokia_sprite *old;
+    size_t len;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+    {
+        return -EFAULT;
+    }
+    if (req.slot >= NOKIA_5110_SPRITES || req.width > ndev->width || req.height > ndev->height ||
+        !req.width != !req.height)
+    {
+        return -EINVAL;
+    }
+
+    if (req.width)
+    {
+        len = req.width * DIV_ROUND_UP(req.height, 8);
+        sprite = kmalloc(sizeof(*sprite) + len, GFP_KERNEL);
+        if (!sprite)
+        {
+            return -ENOMEM;
+        }
+        sprite->width = req.width;
+        sprite->height = req.height;
+        if (copy_from_user(sprite->bits, u64_to_user_ptr(req.bits), len))
+        {
+            kfree(sprite);
+            return -EFAULT;
+        }
+    }
+
+    mutex_lock(&ndev->lock);
+    old = ndev->sprites[req.slot];
+    ndev->sprites[req.slot] = sprite;
+    mutex_unlock(&ndev->lock);
+
+    kfree(old);
+
+    return 0;
+}
+
+/********************************************************
+ *
+ * Draws a batch of sprites as one update
+ *  The batch is queued like a write, and only the
+ *  columns the sprites cover are marked dirty.
+ *  params: 
+ *       arg - the batch, see struct nokia_5110_blits
+ *       nonblock - fail with -EAGAIN when the queue is full
+ *       
+ *********************************************************/
+static int sprite_blits(struct nokia_device *ndev, const struct nokia_5110_blits __user *arg, bool nonblock)
+{
+    struct nokia_5110_blits batch;
+    struct nokia_5110_blit *blits;
+    bool front;
+    int ret = 0;
+    int i;
+
+    if (copy_from_user(&batch, arg, sizeof(batch)))
+    {
+        return -EFAULT;
+    }
+    if (batch.count == 0 || batch.count > NOKIA_5110_MAX_BLITS)
+    {
+        return -EINVAL;
+    }
+
+    blits = kmalloc_array(batch.count, sizeof(*blits), GFP_KERNEL);
+    if (!blits)
+    {
+        return -ENOMEM;
+    }
+    if (copy_from_user(blits, u64_to_user_ptr(batch.blits), batch.count * sizeof(*blits)))
+    {
+        ret = -EFAULT;
+        goto out;
+    }
+    for (i = 0; i < batch.count; i++)
+    {
+        if (blits[i].slot >= NOKIA_5110_SPRITES || blits[i].op > NOKIA_5110_BLIT_XOR)
+        {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    mutex_lock(&ndev->lock);
+    for (i = 0; i < batch.count; i++)
+    {
+        if (!ndev->sprites[blits[i].slot])
+        {
+            mutex_unlock(&ndev->lock);
+            ret = -ENOENT;
+            goto out;
+        }
+    }
+    front = ndev->draw == ndev->vbuffer;
+    if (front)
+    {
+        ret = queue_wait(ndev, nonblock);
+        if (ret)
+        {
+            goto out;
+        }
+    }
+    for (i = 0; i < batch.count; i++)
+    {
+        sprite_blit(ndev, ndev->sprites[blits[i].slot], blits[i].x, blits[i].y, blits[i].op);
+    }
+    if (front)
+    {
+        ndev->write_seq++;
+        schedule_flush(ndev);
+    }
+    mutex_unlock(&ndev->lock);
+
+out:
+    kfree(blits);
+
+    return ret;
+}
+
+// Rows of band of a sprite that hold pixels, 0 past its last band
+static uint8_t sprite_band_mask(const struct nokia_sprite *sprite, int band)
+{
+    int rows = sprite->height - band * 8;
+
+    if (band < 0 || rows <= 0)
+    {
+        return 0;
+    }
+
+    return (rows >= 8) ? 0xff : (1 << rows) - 1;
+}
+
+/********************************************************
+ *
+ * Composites a sprite into the framebuffer
+ *  Unless y is bank aligned, every bank takes the bottom
+ *  of one band of the sprite and the top of the next.
+ *  params: 
+ *       sprite - bitmap to draw
+ *       x, y - top left pixel, parts off the surface are
+ *              clipped
+ *       op - NOKIA_5110_BLIT_ value
+ *  Caller holds ndev->lock.
+ *       
+ *********************************************************/
+static void sprite_blit(struct nokia_device *ndev, const struct nokia_sprite *sprite, int x, int y, int op)
+{
+    const int shift = y & 7;
+    // bank holding the first band, negative when it starts above the surface
+    const int top = (y - shift) / 8;
+    const int bands = DIV_ROUND_UP(sprite->height, 8);
+    const int x0 = max(x, 0);
+    const int x1 = min(x + sprite->width, ndev->width);
+    int bank, c;
+
+    if (x0 >= x1)
+    {
+        return;
+    }
+
+    for (bank = max(top, 0); bank <= min(top + bands, ndev->banks - 1); bank++)
+    {
+        const int band = bank - top;
+        const uint8_t mask = ((sprite_band_mask(sprite, band) << 8 | sprite_band_mask(sprite, band - 1)) << shift) >> 8;
+        uint8_t *out = &ndev->draw[bank * ndev->width];
+
+        if (!mask)
+        {
+            continue;
+        }
+
+        vbuffer_write_begin(ndev);
+        for (c = x0; c < x1; c++)
+        {
+            const uint8_t *col = &sprite->bits[c - x];
+            u16 window = 0;
+            uint8_t bits;
+
+            if (band < bands)
+            {
+                window |= col[band * sprite->width] << 8;
+            }
+            if (band > 0)
+            {
+                window |= col[(band - 1) * sprite->width];
+            }
+            bits = ((window << shift) >> 8) & mask;
+
+            switch (op)
+            {
+            case NOKIA_5110_BLIT_COPY:
+                out[c] = (out[c] & ~mask) | bits;
+                break;
+            case NOKIA_5110_BLIT_OR:
+                out[c] |= bits;
+                break;
+            case NOKIA_5110_BLIT_AND:
+                out[c] &= bits | ~mask;
+                break;
+            case NOKIA_5110_BLIT_XOR:
+                out[c] ^= bits;
+                break;
+            }
+        }
+        vbuffer_write_end(ndev);
+
+        draw_dirty(ndev, bank * ndev->width + x0, x1 - x0);
+    }
+}
+
+ /***************** Transactions *****************/
+
+static void txn_init(struct nokia_txn *txn)
+{
+    txn->nseg = 0;
+    txn->ncommands = 0;
+    txn->bytes = 0;
+}
+
+// Appends a segment, extending the previous one when it continues it
+static int txn_segment(struct nokia_txn *txn, int dc, const uint8_t *buffer, size_t buffer_len)
+{
+    struct nokia_segment *last = txn->nseg ? &txn->seg[txn->nseg - 1] : NULL;
+
+    if (!buffer_len)
+    {
+        return 0;
+    }
+
+    if (last && last->dc == dc && last->buffer + last->len == buffer)
+    {
+        last->len += buffer_len;
+    }
+    else
+    {
+        if (WARN_ON_ONCE(txn->nseg >= NOKIA_TXN_SEGMENTS))
+        {
+            return -ENOSPC;
         }
-        else if ( !escaped && *buffer == '\\' )
+
+        txn->seg[txn->nseg].dc = dc;
+        txn->seg[txn->nseg].buffer = buffer;
+        txn->seg[txn->nseg].len = buffer_len;
+        txn->nseg++;
+    }
+
+    txn->bytes += buffer_len;
+
+    return 0;
+}
+
+static int txn_command(struct nokia_txn *txn, uint8_t command)
+{
+    uint8_t *out;
+
+    if (WARN_ON_ONCE(txn->ncommands >= NOKIA_TXN_COMMANDS))
+    {
+        return -ENOSPC;
+    }
+
+    // back to back commands land next to each other and share a segment
+    out = &txn->commands[txn->ncommands++];
+    *out = command;
+
+    return txn_segment(txn, 0, out, 1);
+}
+
+static int txn_commands(struct nokia_txn *txn, const uint8_t *commands, size_t count)
+{
+    int ret = 0;
+
+    while (count-- && !ret)
+    {
+        ret = txn_command(txn, *commands++);
+    }
+
+    return ret;
+}
+
+static int txn_data(struct nokia_txn *txn, const uint8_t *buffer, size_t buffer_len)
+{
+    return txn_segment(txn, 1, buffer, buffer_len);
+}
+
+// Sends a transaction through the active transport, caller holds panel->bus_lock
+static int txn_submit(struct nokia_panel *panel, struct nokia_txn *txn)
+{
+    ktime_t start;
+    u64 ns;
+    int ret;
+
+    if (!txn->nseg)
+    {
+        return 0;
+    }
+
+    start = ktime_get();
+    ret = nokia.ops->submit(panel, txn);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+    hist_add(&panel->ndev->byte_time, div64_u64(ns, txn->bytes));
+    panel->xfer_bits += txn->bytes * 8;
+    panel->xfer_ns += ns;
+    panel->transactions++;
+    panel->segments += txn->nseg;
+
+    return ret;
+}
+
+// Drives D/C, skipping the write when the line is already at level
+static void set_dc(struct nokia_panel *panel, int level)
+{
+    if (panel->dc_level != level)
+    {
+        gpiod_set_value_cansleep(panel->dc, level);
+        panel->dc_level = level;
+        panel->gpio_toggles++;
+        panel->gpio_writes++;
+    }
+}
+
+
+ /***************** Framebuffer Device *****************/
+
+// the fbdev ops are built on the system memory helpers, deferred IO alone is not enough
+#if IS_ENABLED(CONFIG_FB_DEFERRED_IO) && IS_ENABLED(CONFIG_FB_SYS_FOPS) && \
+    IS_ENABLED(CONFIG_FB_SYS_FILLRECT) && IS_ENABLED(CONFIG_FB_SYS_COPYAREA) && IS_ENABLED(CONFIG_FB_SYS_IMAGEBLIT)
+
+/* The fbdev view is the whole surface in XRGB8888, 84x48 for a
+single panel.  Pages written through it are picked up by deferred IO,
+converted to monochrome and handed to the flush workers like any other
+framebuffer update. */
+
+
+/********************************************************
+ *
+ * Converts XRGB8888 rows of the fbdev memory into the 
+ *  panel framebuffer and queues a flush
+ *  params: 
+ *       info - fbdev being updated
+ *       y0 - first row
+ *       y1 - row past the last one
+ *       
+ *********************************************************/
+static void nokia_fb_update(struct fb_info *info, int y0, int y1)
+{
+    struct nokia_device *ndev = info->par;
+    const u32 *src = (const u32 *)info->screen_buffer;
+    const size_t stride = DIV_ROUND_UP(ndev->width, 8);
+    int x, y;
+
+    // whole banks are converted at a time
+    y0 = clamp(y0, 0, ndev->height) & ~7;
+    y1 = ALIGN(clamp(y1, y0, ndev->height), 8);
+    if (y0 == y1)
+    {
+        return;
+    }
+
+    mutex_lock(&ndev->lock);
+    for (y = y0; y < y1; y++)
+    {
+        const u32 *row = &src[y * ndev->width];
+        uint8_t *mono = &ndev->fb_mono[y * stride];
+
+        memset(mono, 0, stride);
+        for (x = 0; x < ndev->width; x++)
         {
-            escaped = 1;
+            // BT.601 luma, dark pixels turn black
+            u32 luma = (77 * ((row[x] >> 16) & 0xff) + 151 * ((row[x] >> 8) & 0xff) + 28 * (row[x] & 0xff)) >> 8;
+
+            mono[x / 8] |= (luma < 128) << (7 - x % 8);
         }
-        else
+    }
+    vbuffer_write_begin(ndev);
+    nokia_mono_to_native(&ndev->fb_mono[y0 * stride], stride,
+                         &ndev->vbuffer[(y0 / 8) * ndev->width], ndev->width, y1 - y0);
+    vbuffer_write_end(ndev);
+    mark_dirty(ndev, (y0 / 8) * ndev->width, (y1 - y0) / 8 * ndev->width);
+    schedule_flush(ndev);
+    mutex_unlock(&ndev->lock);
+}
+
+static void nokia_fb_deferred_io(struct fb_info *info, struct list_head *pagereflist)
+{
+    struct nokia_device *ndev = info->par;
+    const u32 line_length = info->fix.line_length;
+    struct fb_deferred_io_pageref *pageref;
+    int y0 = ndev->height;
+    int y1 = 0;
+
+    unsigned long flags;
+
+    list_for_each_entry(pageref, pagereflist, list)
+    {
+        unsigned long start = pageref->offset;
+
+        y0 = min_t(int, y0, start / line_length);
+        y1 = max_t(int, y1, DIV_ROUND_UP(start + PAGE_SIZE, line_length));
+    }
+
+    // plus whatever the drawing ops changed
+    spin_lock_irqsave(&ndev->fb_lock, flags);
+    y0 = min(y0, ndev->fb_y0);
+    y1 = max(y1, ndev->fb_y1);
+    ndev->fb_y0 = ndev->height;
+    ndev->fb_y1 = 0;
+    spin_unlock_irqrestore(&ndev->fb_lock, flags);
+
+    nokia_fb_update(info, y0, y1);
+}
+
+/* Drawing ops can be called in atomic context, e.g. by fbcon, where
+the surface lock cannot be taken.  They only record the rows they
+changed and leave the conversion to the deferred IO work. */
+static void nokia_fb_mark(struct fb_info *info, int y0, int y1)
+{
+    struct nokia_device *ndev = info->par;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ndev->fb_lock, flags);
+    ndev->fb_y0 = min(ndev->fb_y0, y0);
+    ndev->fb_y1 = max(ndev->fb_y1, y1);
+    spin_unlock_irqrestore(&ndev->fb_lock, flags);
+
+    schedule_delayed_work(&info->deferred_work, 0);
+}
+
+static ssize_t nokia_fb_write(struct fb_info *info, const char __user *buf, size_t count, loff_t *ppos)
+{
+    loff_t start = *ppos;
+    ssize_t ret = fb_sys_write(info, buf, count, ppos);
+
+    if (ret > 0)
+    {
+        nokia_fb_update(info, start / info->fix.line_length, DIV_ROUND_UP(*ppos, info->fix.line_length));
+    }
+
+    return ret;
+}
+
+static void nokia_fb_fillrect(struct fb_info *info, const struct fb_fillrect *rect)
+{
+    sys_fillrect(info, rect);
+    nokia_fb_mark(info, rect->dy, rect->dy + rect->height);
+}
+
+static void nokia_fb_copyarea(struct fb_info *info, const struct fb_copyarea *area)
+{
+    sys_copyarea(info, area);
+    nokia_fb_mark(info, area->dy, area->dy + area->height);
+}
+
+static void nokia_fb_imageblit(struct fb_info *info, const struct fb_image *image)
+{
+    sys_imageblit(info, image);
+    nokia_fb_mark(info, image->dy, image->dy + image->height);
+}
+
+static int nokia_fb_setcolreg(unsigned regno, unsigned red, unsigned green, unsigned blue, unsigned transp, struct fb_info *info)
+{
+    struct nokia_device *ndev = info->par;
+
+    if (regno >= ARRAY_SIZE(ndev->fb_palette))
+    {
+        return -EINVAL;
+    }
+
+    ndev->fb_palette[regno] = ((red >> 8) << 16) | ((green >> 8) << 8) | (blue >> 8);
+
+    return 0;
+}
+
+static struct fb_ops nokia_fb_ops =
+{
+    .owner = THIS_MODULE,
+    .fb_read = fb_sys_read,
+    .fb_write = nokia_fb_write,
+    .fb_mmap = fb_deferred_io_mmap,
+    .fb_setcolreg = nokia_fb_setcolreg,
+    .fb_fillrect = nokia_fb_fillrect,
+    .fb_copyarea = nokia_fb_copyarea,
+    .fb_imageblit = nokia_fb_imageblit
+};
+
+static struct fb_fix_screeninfo nokia_fb_fix =
+{
+    .id = "nokia_5110",
+    .type = FB_TYPE_PACKED_PIXELS,
+    .visual = FB_VISUAL_TRUECOLOR,
+    .accel = FB_ACCEL_NONE
+};
+
+static struct fb_var_screeninfo nokia_fb_var =
+{
+    .bits_per_pixel = 32,
+    .red = { 16, 8, 0 },
+    .green = { 8, 8, 0 },
+    .blue = { 0, 8, 0 },
+    .activate = FB_ACTIVATE_NOW,
+    .vmode = FB_VMODE_NONINTERLACED
+};
+
+static int nokia_fb_register(struct nokia_device *ndev)
+{
+    const u32 line_length = ndev->width * 4;
+    const u32 size = line_length * ndev->height;
+    struct fb_info *info;
+    u32 *vmem;
+    int x, y;
+    int ret;
+
+    ndev->fb_mono = kmalloc(DIV_ROUND_UP(ndev->width, 8) * ndev->height, GFP_KERNEL);
+    if (!ndev->fb_mono)
+    {
+        return -ENOMEM;
+    }
+    spin_lock_init(&ndev->fb_lock);
+    ndev->fb_y0 = ndev->height;
+    ndev->fb_y1 = 0;
+
+    // deferred IO maps this memory page by page, so it has to be vmalloc'd
+    vmem = vzalloc(size);
+    if (!vmem)
+    {
+        ret = -ENOMEM;
+        goto err_mono;
+    }
+
+    info = framebuffer_alloc(0, ndev->dev);
+    if (!info)
+    {
+        ret = -ENOMEM;
+        goto err_vmem;
+    }
+
+    info->fbops = &nokia_fb_ops;
+    info->fix = nokia_fb_fix;
+    info->fix.line_length = line_length;
+    info->fix.smem_len = size;
+    info->var = nokia_fb_var;
+    info->var.xres = info->var.xres_virtual = ndev->width;
+    info->var.yres = info->var.yres_virtual = ndev->height;
+    info->screen_buffer = (char *)vmem;
+    info->screen_size = size;
+    info->pseudo_palette = ndev->fb_palette;
+    info->par = ndev;
+    info->flags = FBINFO_VIRTFB;
+
+    // pick up mmap writes at the flush worker's rate
+    ndev->fb_defio.delay = max_t(unsigned long, HZ / maxFps, 1);
+    ndev->fb_defio.deferred_io = nokia_fb_deferred_io;
+    info->fbdefio = &ndev->fb_defio;
+    ret = fb_deferred_io_init(info);
+    if (ret)
+    {
+        goto err_release;
+    }
+
+    // start out showing what the panel shows
+    mutex_lock(&ndev->lock);
+    for (y = 0; y < ndev->height; y++)
+    {
+        for (x = 0; x < ndev->width; x++)
+        {
+            vmem[y * ndev->width + x] = (ndev->vbuffer[(y / 8) * ndev->width + x] & (1 << (y % 8))) ? 0x000000 : 0xffffff;
+        }
+    }
+    mutex_unlock(&ndev->lock);
+
+    ret = register_framebuffer(info);
+    if (ret)
+    {
+        goto err_info;
+    }
+
+    ndev->fb = info;
+    printk(KERN_INFO "fb%d: nokia_5110 framebuffer device for nokia%d, %dx%d", info->node, ndev->index, ndev->width, ndev->height);
+
+    return 0;
+
+err_info:
+    fb_deferred_io_cleanup(info);
+err_release:
+    framebuffer_release(info);
+err_vmem:
+    vfree(vmem);
+err_mono:
+    kfree(ndev->fb_mono);
+    ndev->fb_mono = NULL;
+
+    return ret;
+}
+
+static void nokia_fb_unregister(struct nokia_device *ndev)
+{
+    struct fb_info *info = ndev->fb;
+
+    if (!info)
+    {
+        return;
+    }
+
+    unregister_framebuffer(info);
+    fb_deferred_io_cleanup(info);
+    vfree(info->screen_buffer);
+    framebuffer_release(info);
+    kfree(ndev->fb_mono);
+    ndev->fb_mono = NULL;
+    ndev->fb = NULL;
+}
+
+#else
+
+static int nokia_fb_register(struct nokia_device *ndev)
+{
+    printk(KERN_INFO "Kernel built without CONFIG_FB_DEFERRED_IO or the FB_SYS_* helpers, no framebuffer device");
+
+    return 0;
+}
+
+static void nokia_fb_unregister(struct nokia_device *ndev)
+{
+}
+
+#endif // CONFIG_FB_DEFERRED_IO && CONFIG_FB_SYS_*
+
+
+ /***************** Debugfs *****************/
+
+/* /sys/kernel/debug/nokia_5110/nokiaN/ holds log2 latency histograms
+and the cumulative counters, for profiling without the sysfs ABI. */
+
+static void hist_add(struct nokia_hist *hist, u64 value)
+{
+    int bucket = value ? min(ilog2(value) + 1, NOKIA_HIST_BUCKETS - 1) : 0;
+
+    atomic64_inc(&hist->count[bucket]);
+}
+
+static int hist_show(struct seq_file *m, void *v)
+{
+    struct nokia_hist *hist = m->private;
+    int bucket;
+
+    seq_printf(m, "%12s %12s %12s\n", "from_ns", "to_ns", "count");
+    for (bucket = 0; bucket < NOKIA_HIST_BUCKETS; bucket++)
+    {
+        long long count = atomic64_read(&hist->count[bucket]);
+
+        if (count)
+        {
+            seq_printf(m, "%12llu %12llu %12lld\n", bucket ? 1ULL << (bucket - 1) : 0ULL, (1ULL << bucket) - 1, count);
+        }
+    }
+
+    return 0;
+}
+
+static int hist_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hist_show, inode->i_private);
+}
+
+static const struct file_operations hist_fops =
+{
+    .owner = THIS_MODULE,
+    .open = hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static int counters_show(struct seq_file *m, void *v)
+{
+    struct nokia_device *ndev = m->private;
+    u64 requested;
+
+    mutex_lock(&ndev->lock);
+    requested = ndev->bytes_requested;
+    mutex_unlock(&ndev->lock);
+
+    seq_printf(m, "bytes_requested %llu\n", requested);
+    seq_printf(m, "bytes_sent %llu\n", panel_sum(ndev, offsetof(struct nokia_panel, bytes_sent)));
+    seq_printf(m, "frames_flushed %llu\n", panel_sum(ndev, offsetof(struct nokia_panel, frames_flushed)));
+
+    return 0;
+}
+
+static int counters_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, counters_show, inode->i_private);
+}
+
+static const struct file_operations counters_fops =
+{
+    .owner = THIS_MODULE,
+    .open = counters_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release
+};
+
+static void nokia_debugfs_create(struct nokia_device *ndev)
+{
+    char name[16];
+
+    snprintf(name, sizeof(name), "nokia%d", ndev->index);
+    ndev->debugfs = debugfs_create_dir(name, nokia.debugfs);
+
+    debugfs_create_file("write_latency", 0444, ndev->debugfs, &ndev->write_latency, &hist_fops);
+    debugfs_create_file("byte_time", 0444, ndev->debugfs, &ndev->byte_time, &hist_fops);
+    debugfs_create_file("counters", 0444, ndev->debugfs, ndev, &counters_fops);
+}
+
+
+ /***************** GPIO Transport *****************/
+
+static int gpio_transport_init(struct nokia_panel *panel)
+{
+    int ret;
+
+    ret = panel_line_request(panel->gpio_sce, "nokia_5110 sce", 1, &panel->sce);
+    if (ret)
+    {
+        return ret;
+    }
+
+    ret = panel_line_request(panel->gpio_sclk, "nokia_5110 sclk", 0, &panel->sclk);
+    if (ret)
+    {
+        goto err_sce;
+    }
+    panel->sclk_level = 0;
+
+    ret = panel_line_request(panel->gpio_dout, "nokia_5110 din", 0, &panel->dout);
+    if (ret)
+    {
+        goto err_sclk;
+    }
+    panel->din_level = 0;
+
+    return 0;
+
+err_sclk:
+    gpio_free(panel->gpio_sclk);
+err_sce:
+    gpio_free(panel->gpio_sce);
+
+    return ret;
+}
+
+static void gpio_transport_exit(struct nokia_panel *panel)
+{
+    gpio_unexport(panel->gpio_sce);
+
+    gpio_unexport(panel->gpio_dout);
+    gpio_unexport(panel->gpio_sclk);
+
+    gpio_free(panel->gpio_sce);
+
+    gpio_free(panel->gpio_dout);
+    gpio_free(panel->gpio_sclk);
+}
+
+
+// Waits out the remainder of the current SCLK half period, sleeping through long ones
+static void sclk_pace(ktime_t *next, u64 half_period_ns)
+{
+    ktime_t now = ktime_get();
+    s64 remaining;
+
+    *next = ktime_add_ns(*next, half_period_ns);
+    remaining = ktime_to_ns(ktime_sub(*next, now));
+
+    if (remaining >= NOKIA_SCLK_SLEEP_NS)
+    {
+        // slow clocks, e.g. for the emulator, would otherwise spin for seconds a frame
+        usleep_range(div_u64(remaining, NSEC_PER_USEC), div_u64(remaining, NSEC_PER_USEC) + 10);
+    }
+    else if (remaining > 0)
+    {
+        ndelay(remaining);
+    }
+    else
+    {
+        // the GPIO path is slower than the requested rate, never burst to catch up
+        *next = now;
+    }
+}
+
+/********************************************************
+ *
+ * Clocks bytes out on DIN, MSB first
+ *  DIN is sampled on the rising edge, so the next bit can
+ *  be set up on the falling one.  When DIN changes both
+ *  lines go out as one array write, a single register
+ *  write on controllers that set several lines at once.
+ *  Runs of equal bits leave DIN alone.  Transfers run
+ *  in process context under bus_lock, so the lines may
+ *  sleep, as on expanders and gpio-sim.
+ *       
+ *********************************************************/
+static void raw_out(struct nokia_panel *panel, const uint8_t *buffer, size_t buffer_len, ktime_t *next, u64 half_period_ns)
+{
+    struct gpio_desc *lines[2] = { panel->sclk, panel->dout };
+
+    while (buffer_len)
+    {
+        int bits = 8;
+        uint8_t out = *buffer;
+
+        while (bits)
         {
-            printk(KERN_WARNING "\033[31mChar index %d out of bounds.\033[0m", index);
-        }
+            int din = (0x80 & out) ? 1 : 0;
 
+            if (din != panel->din_level && panel->sclk_level)
+            {
+                // bit 0 is SCLK, brought low, bit 1 DIN
+                unsigned long values = din ? BIT(1) : 0;
+
+                gpiod_set_array_value_cansleep(2, lines, NULL, &values);
+                panel->gpio_writes++;
+            }
+            else if (din != panel->din_level)
+            {
+                gpiod_set_value_cansleep(panel->dout, din);
+                panel->gpio_writes++;
+            }
+            else if (panel->sclk_level)
+            {
+                gpiod_set_value_cansleep(panel->sclk, 0);
+                panel->gpio_writes++;
+            }
+            panel->din_level = din;
+            panel->sclk_level = 0;
+            sclk_pace(next, half_period_ns);
+
+            gpiod_set_value_cansleep(panel->sclk, 1);
+            panel->sclk_level = 1;
+            panel->gpio_writes++;
+            sclk_pace(next, half_period_ns);
+
+            out <<= 1;
+            bits--;
+        }
         buffer++;
         buffer_len--;
+
+        // short half periods are spun out, long transactions still give way once a byte
+        cond_resched();
+    }
+}
+
+// Sends a whole transaction with SCE held low throughout
+static int gpio_submit(struct nokia_panel *panel, const struct nokia_txn *txn)
+{
+    const u64 half_period_ns = DIV_ROUND_UP(NSEC_PER_SEC, 2 * READ_ONCE(sclkHz));
+    ktime_t next = ktime_get();
+    int i;
+
+    gpiod_set_value_cansleep(panel->sce, 0);
+
+    for (i = 0; i < txn->nseg; i++)
+    {
+        ktime_t start = trace_nokia_5110_xfer_enabled() ? ktime_get() : 0;
+
+        set_dc(panel, txn->seg[i].dc);
+        raw_out(panel, txn->seg[i].buffer, txn->seg[i].len, &next, half_period_ns);
+
+        if (start)
+        {
+            trace_nokia_5110_xfer(panel->index, txn->seg[i].dc, txn->seg[i].len, ktime_to_ns(ktime_sub(ktime_get(), start)));
+        }
     }
 
+    // SCLK comes down after SCE so the idle edge is ignored, DIN is left where it is
+    gpiod_set_value_cansleep(panel->sce, 1);
+    gpiod_set_value_cansleep(panel->sclk, 0);
+    panel->sclk_level = 0;
+    panel->gpio_toggles += 2;
+    panel->gpio_writes += 3;
+
     return 0;
 }
 
 
+ /***************** SPI Transport *****************/
 
-static int command_out(uint8_t *buffer, size_t buffer_len)
+static int nokia_spi_probe(struct spi_device *spi)
 {
-    gpio_set_value(gpioDc, 0);
+    int ret;
+    int i;
+
+    // PCD8544 samples DIN MSB first on the rising edge of SCLK
+    spi->mode = SPI_MODE_0;
+    spi->bits_per_word = 8;
+    if (!spi->max_speed_hz || spi->max_speed_hz > LCD_SCLK_MAX_HZ)
+    {
+        spi->max_speed_hz = LCD_SCLK_MAX_HZ;
+    }
+
+    ret = spi_setup(spi);
+    if (ret)
+    {
+        dev_err(&spi->dev, "Could not set up SPI device: %d", ret);
+        return ret;
+    }
+
+    // not claimed by a panel yet
+    spi_set_drvdata(spi, NULL);
+
+    mutex_lock(&nokia_spi_lock);
+    for (i = 0; i < NOKIA_MAX_PANELS && nokia.spi_bound[i]; i++)
+    {
+    }
+    if (i < NOKIA_MAX_PANELS)
+    {
+        nokia.spi_bound[i] = spi;
+        // controllers can probe long after the module loaded
+        spi_attach();
+    }
+    mutex_unlock(&nokia_spi_lock);
+
+    if (i == NOKIA_MAX_PANELS)
+    {
+        dev_err(&spi->dev, "Already driving %d panels", NOKIA_MAX_PANELS);
+        return -ENOSPC;
+    }
 
-    return raw_out(buffer, buffer_len);
+    dev_info(&spi->dev, "PCD8544 bound at %u Hz", spi->max_speed_hz);
+
+    return 0;
 }
 
+static void nokia_spi_remove(struct spi_device *spi)
+{
+    struct nokia_panel *panel;
+    int i;
+
+    mutex_lock(&nokia_spi_lock);
+    panel = spi_get_drvdata(spi);
+    if (panel)
+    {
+        struct nokia_device *ndev = panel->ndev;
+
+        // the surface goes back to waiting, the next PCD8544 to bind gets a fresh bring-up
+        cancel_work_sync(&ndev->bringup_work);
+        ndev->bringup_queued = false;
 
-static int data_out(const uint8_t *buffer, size_t buffer_len)
+        mutex_lock(&panel->bus_lock);
+        panel->spi = NULL;
+        // the next panel may be another chip, lcd_init() rewrites the shadow before anything is diffed against it
+        memset(panel->shadow, 0, sizeof(panel->shadow));
+        mutex_unlock(&panel->bus_lock);
+
+        mutex_lock(&ndev->lock);
+        ndev->state = NOKIA_STATE_INIT;
+        mutex_unlock(&ndev->lock);
+    }
+
+    for (i = 0; i < NOKIA_MAX_PANELS; i++)
+    {
+        if (nokia.spi_bound[i] == spi)
+        {
+            nokia.spi_bound[i] = NULL;
+        }
+    }
+    mutex_unlock(&nokia_spi_lock);
+}
+
+/********************************************************
+ *
+ * Pairs the PCD8544s bound to the driver with the panels
+ *  still waiting for one, in probe order, and starts the
+ *  bring-up of every surface whose panels all have one.
+ *  Runs whenever either side appears, so it does not
+ *  matter whether the controller probes before or after
+ *  the module is loaded.  Caller holds nokia_spi_lock.
+ *       
+ *********************************************************/
+static void spi_attach(void)
 {
-    gpio_set_value(gpioDc, 1);
+    int d, p, i;
+
+    for (d = 0; d < nokia.ndevices; d++)
+    {
+        struct nokia_device *ndev = nokia.devices[d];
+        bool attached = true;
+
+        for (p = 0; p < ndev->npanels; p++)
+        {
+            struct nokia_panel *panel = ndev->panels[p];
+
+            for (i = 0; i < NOKIA_MAX_PANELS && !panel->spi; i++)
+            {
+                struct spi_device *spi = nokia.spi_bound[i];
+
+                if (spi && !spi_get_drvdata(spi))
+                {
+                    spi_set_drvdata(spi, panel);
+                    mutex_lock(&panel->bus_lock);
+                    panel->spi = spi;
+                    mutex_unlock(&panel->bus_lock);
+                    dev_info(&spi->dev, "Driving panel %d", panel->index);
+                }
+            }
 
-    return raw_out(buffer, buffer_len);
+            attached = attached && panel->spi;
+        }
+
+        if (attached && !ndev->bringup_queued)
+        {
+            ndev->bringup_queued = true;
+            queue_work(nokia_wq, &ndev->bringup_work);
+        }
+    }
 }
 
+static int spi_transport_init(struct nokia_panel *panel)
+{
+    // bounce buffer for transfers, callers pass stack and rodata buffers
+    panel->spi_buf = kmalloc(panel_len, GFP_KERNEL);
+    if (!panel->spi_buf)
+    {
+        return -ENOMEM;
+    }
+
+    // the device is taken by spi_attach() once the surface is published, or once it binds
+    return 0;
+}
 
-static int raw_out(const uint8_t *buffer, size_t buffer_len)
+static void spi_transport_exit(struct nokia_panel *panel)
 {
-    unsigned long delta = 1 * HZ / 10000; // every 25 ms
-    unsigned long now = get_jiffies_64();
-    unsigned long next = now + delta;
+    mutex_lock(&nokia_spi_lock);
+    if (panel->spi)
+    {
+        spi_set_drvdata(panel->spi, NULL);
+        panel->spi = NULL;
+    }
+    mutex_unlock(&nokia_spi_lock);
 
-    gpio_set_value(gpioSce, 0);
+    kfree(panel->spi_buf);
+}
 
-    while (buffer_len)
+/********************************************************
+ *
+ * Sends a whole transaction as one chip select assertion
+ *  D/C can only change between SPI messages, so each
+ *  segment is its own message.  The bus is locked for
+ *  the batch and every message but the last asks the
+ *  controller to leave CS asserted.  Panels on different
+ *  controllers transfer concurrently, panels sharing one
+ *  take turns.
+ *       
+ *********************************************************/
+static int spi_submit(struct nokia_panel *panel, const struct nokia_txn *txn)
+{
+    struct spi_transfer xfer = { 0 };
+    struct spi_message msg;
+    int ret = 0;
+    int i;
+
+    if (!panel->spi)
     {
-        int bits = 8;
-        uint8_t out = *buffer;
+        return -ENODEV;
+    }
 
-        while (bits)
-        {
-            // MSB first
-            gpio_set_value(gpioDout, (0x80 & out) ? 1 : 0);
+    xfer.tx_buf = panel->spi_buf;
+    xfer.speed_hz = min_t(u32, READ_ONCE(sclkHz), panel->spi->max_speed_hz);
 
-            gpio_set_value(gpioSclk, 1);
+    spi_bus_lock(panel->spi->controller);
 
-            out <<= 1;
+    for (i = 0; i < txn->nseg && !ret; i++)
+    {
+        const uint8_t *buffer = txn->seg[i].buffer;
+        size_t buffer_len = txn->seg[i].len;
+        ktime_t start = trace_nokia_5110_xfer_enabled() ? ktime_get() : 0;
 
-            while (!time_after(now, next))
-            {
-                now = get_jiffies_64();
-            }
+        set_dc(panel, txn->seg[i].dc);
 
-            next = now + delta;
+        while (buffer_len && !ret)
+        {
+            size_t chunk = min(buffer_len, panel_len);
 
-            gpio_set_value(gpioSclk, 0);
+            memcpy(panel->spi_buf, buffer, chunk);
+            xfer.len = chunk;
+            xfer.cs_change = (i < txn->nseg - 1 || chunk < buffer_len);
 
-            while (!time_after(now, next))
-            {
-                now = get_jiffies_64();
-            }
+            spi_message_init(&msg);
+            spi_message_add_tail(&xfer, &msg);
+            ret = spi_sync_locked(panel->spi, &msg);
 
-            next = now + delta;
+            buffer += chunk;
+            buffer_len -= chunk;
+        }
 
-            bits--;
+        if (start)
+        {
+            trace_nokia_5110_xfer(panel->index, txn->seg[i].dc, txn->seg[i].len, ktime_to_ns(ktime_sub(ktime_get(), start)));
         }
-        buffer++;
-        buffer_len--;
     }
 
-    gpio_set_value(gpioSce, 1);
-    gpio_set_value(gpioDout, 0);
-    gpio_set_value(gpioSclk, 0);
+    spi_bus_unlock(panel->spi->controller);
 
-    return 0;
+    return ret;
 }
 
 
  /***************** LCD Commands *****************/
-#if 0
+
+ /* Each command is appended to a transaction, which the caller
+ submits once it holds everything that should go out together. */
+
  // set y
- static int set_y(int y_pos)
+ static int set_y(struct nokia_txn *txn, int y_pos)
  {
      uint8_t command = LCD_COMMAND_SET_Y;
-     if( y_pos >= 5 )
+     if( y_pos >= LCD_BANKS )
      {
          printk(KERN_WARNING "Invalid y position %d", y_pos);
          return -1;
@@ -504,17 +4859,15 @@ static int raw_out(const uint8_t *buffer, size_t buffer_len)
 
      command |= y_pos;
 
-     command_out(&command, 1 );
-
-     return 0;
+     return txn_command(txn, command);
  }
 
  // set x
- static int set_x(int x_pos)
+ static int set_x(struct nokia_txn *txn, int x_pos)
  {
      uint8_t command = LCD_COMMAND_SET_X;
 
-     if( x_pos >= 83 )
+     if( x_pos >= LCD_WIDTH )
      {
          printk(KERN_WARNING "Invalid x position %d", x_pos);
          return -1;
@@ -522,40 +4875,31 @@ static int raw_out(const uint8_t *buffer, size_t buffer_len)
 
      command |= x_pos;
 
-     command_out(&command, 1 );
-
-     return 0;
+     return txn_command(txn, command);
  }
 
+#if 0
+
 // set display to normal
-static int set_display_normal(void)
+static int set_display_normal(struct nokia_txn *txn)
 {
-    uint8_t command = LCD_COMMAND_DISP_CTRL | 0x04;
-    command_out(&command, 1 );
-
-    return 0;
+    return txn_command(txn, LCD_COMMAND_DISP_CTRL | 0x04);
 }
 
 // set display pixels to black
-static int set_display_black(void)
+static int set_display_black(struct nokia_txn *txn)
 {
-    uint8_t command = LCD_COMMAND_DISP_CTRL | 0x01;
-    command_out(&command, 1 );
-
-    return 0;
+    return txn_command(txn, LCD_COMMAND_DISP_CTRL | 0x01);
 }
 
 // set display to inverse mode
-static int set_display_inverse(void)
+static int set_display_inverse(struct nokia_txn *txn)
 {
-    uint8_t command = LCD_COMMAND_DISP_CTRL | 0x05;
-    command_out(&command, 1);
-
-    return 0;
+    return txn_command(txn, LCD_COMMAND_DISP_CTRL | 0x05);
 }
 
 // set temperature coefficient
-static int set_temperature_control(uint8_t temp_coeff)
+static int set_temperature_control(struct nokia_txn *txn, uint8_t temp_coeff)
 {
     uint8_t commands_lst[] = 
     {
@@ -564,13 +4908,11 @@ static int set_temperature_control(uint8_t temp_coeff)
         LCD_COMMAND_FUNCT_SET
     };
 
-    command_out(commands_lst, sizeof(commands_lst));
-
-    return 0;
+    return txn_commands(txn, commands_lst, sizeof(commands_lst));
 }
 
 // set contrast
-static int set_lcd_contrast(uint8_t bias)
+static int set_lcd_contrast(struct nokia_txn *txn, uint8_t bias)
 {
     uint8_t commands_lst[] = 
     {
@@ -579,9 +4921,7 @@ static int set_lcd_contrast(uint8_t bias)
         LCD_COMMAND_FUNCT_SET
     };
 
-    command_out(commands_lst, sizeof(commands_lst));
-
-    return 0;
+    return txn_commands(txn, commands_lst, sizeof(commands_lst));
 }
 #endif // 0
 // Attribute show store wrappers
@@ -591,3 +4931,241 @@ static ssize_t bias_show(struct kobject *kobj, struct kobj_attribute *attr, char
     return sprintf(buf, "%du", nokiaBias);
 }
 
+static ssize_t sclk_hz_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", sclkHz);
+}
+
+static ssize_t sclk_hz_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int hz;
+    int ret = kstrtouint(buf, 0, &hz);
+    int i;
+
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (hz < LCD_SCLK_MIN_HZ || hz > LCD_SCLK_MAX_HZ)
+    {
+        return -EINVAL;
+    }
+
+    // restart the bit rate measurements at the new clock
+    WRITE_ONCE(sclkHz, hz);
+    mutex_lock(&nokia_spi_lock);
+    for (i = 0; i < nokia.ndevices; i++)
+    {
+        struct nokia_device *ndev = nokia.devices[i];
+        int j;
+
+        for (j = 0; j < ndev->npanels; j++)
+        {
+            struct nokia_panel *panel = ndev->panels[j];
+
+            mutex_lock(&panel->bus_lock);
+            panel->xfer_bits = 0;
+            panel->xfer_ns = 0;
+            mutex_unlock(&panel->bus_lock);
+        }
+    }
+    mutex_unlock(&nokia_spi_lock);
+
+    return count;
+}
+
+static ssize_t max_fps_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", maxFps);
+}
+
+static ssize_t max_fps_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    unsigned int fps;
+    int ret = kstrtouint(buf, 0, &fps);
+
+    if (ret)
+    {
+        return ret;
+    }
+
+    if (fps < 1 || fps > NOKIA_MAX_FPS)
+    {
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(maxFps, fps);
+
+    return count;
+}
+
+// Sums a u64 bus counter, found at offset in struct nokia_panel, over a surface's panels
+static u64 panel_sum(struct nokia_device *ndev, size_t offset)
+{
+    u64 sum = 0;
+    int i;
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        struct nokia_panel *panel = ndev->panels[i];
+
+        mutex_lock(&panel->bus_lock);
+        sum += *(u64 *)((char *)panel + offset);
+        mutex_unlock(&panel->bus_lock);
+    }
+
+    return sum;
+}
+
+static ssize_t width_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", ndev->width);
+}
+
+static ssize_t height_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", ndev->height);
+}
+
+static ssize_t state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    static const char * const names[] =
+    {
+        [NOKIA_STATE_INIT] = "initializing",
+        [NOKIA_STATE_READY] = "ready",
+        [NOKIA_STATE_FAILED] = "failed",
+    };
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%s\n", names[READ_ONCE(ndev->state)]);
+}
+
+// Bit rate achieved on the bus since load or the last sclk_hz change, panels transfer in parallel so this is their total
+static ssize_t bitrate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 rate = 0;
+    int i;
+
+    for (i = 0; i < ndev->npanels; i++)
+    {
+        struct nokia_panel *panel = ndev->panels[i];
+        u64 bits, ns;
+
+        mutex_lock(&panel->bus_lock);
+        bits = panel->xfer_bits;
+        ns = panel->xfer_ns;
+        mutex_unlock(&panel->bus_lock);
+
+        rate += ns ? div64_u64(bits * NSEC_PER_SEC, ns) : 0;
+    }
+
+    return sprintf(buf, "%llu\n", rate);
+}
+
+static ssize_t bytes_requested_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 count;
+
+    mutex_lock(&ndev->lock);
+    count = ndev->bytes_requested;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%llu\n", count);
+}
+
+static ssize_t bytes_sent_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, bytes_sent)));
+}
+
+static ssize_t frames_flushed_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, frames_flushed)));
+}
+
+static ssize_t writes_coalesced_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 count;
+
+    mutex_lock(&ndev->lock);
+    count = ndev->writes_coalesced;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%llu\n", count);
+}
+
+static ssize_t frames_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 count;
+
+    mutex_lock(&ndev->lock);
+    count = ndev->frames_dropped;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%llu\n", count);
+}
+
+static ssize_t plane_rate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u32 rate;
+
+    mutex_lock(&ndev->lock);
+    rate = ndev->planes ? ndev->plane_rate : 0;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%u\n", rate);
+}
+
+static ssize_t planes_shown_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 count;
+
+    mutex_lock(&ndev->lock);
+    count = ndev->planes_shown;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%llu\n", count);
+}
+
+static ssize_t planes_missed_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct nokia_device *ndev = dev_get_drvdata(dev);
+    u64 count;
+
+    mutex_lock(&ndev->lock);
+    count = ndev->planes_missed;
+    mutex_unlock(&ndev->lock);
+
+    return sprintf(buf, "%llu\n", count);
+}
+
+static ssize_t transactions_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, transactions)));
+}
+
+static ssize_t segments_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, segments)));
+}
+
+static ssize_t gpio_toggles_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, gpio_toggles)));
+}
+
+static ssize_t gpio_writes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", panel_sum(dev_get_drvdata(dev), offsetof(struct nokia_panel, gpio_writes)));
+}
@@ -16,9 +16,14 @@ LED (backlight) pin should remain on a PWM-capable pin. */
 #define LCD_COMMAND 0
 #define LCD_DATA 1
 
+/* Serial interface limits */
+#define LCD_SCLK_MAX_HZ 4000000 // PCD8544 maximum serial clock
+#define LCD_SCLK_MIN_HZ 1000    // slowest rate the bit-bang engine will pace
+
 /* 84x48 LCD Defines: */
 #define LCD_WIDTH 84  // Note: x-coordinates go wide
 #define LCD_HEIGHT 48 // Note: y-coordinates go high
+#define LCD_BANKS (LCD_HEIGHT / 8) // 8-pixel rows addressed by LCD_COMMAND_SET_Y
 #define WHITE 0       // For drawing pixels. A 0 draws white.
 #define BLACK 1       // A 1 draws black.
 
@@ -255,6 +260,204 @@ static const uint8_t ASCII[][5] = {
     {0x78, 0x46, 0x41, 0x46, 0x78} // 0x7f DEL
 };
 
+/* Small font table:
+A font that is 3 pixels wide and 5 pixels high, laid out like
+ASCII above with 3 bytes per character.  Lowercase letters are
+drawn as small capitals. */
+static const uint8_t ASCII_SMALL[][3] = {
+    {0x00, 0x00, 0x00} // 0x20
+    ,
+    {0x00, 0x17, 0x00} // 0x21 !
+    ,
+    {0x03, 0x00, 0x03} // 0x22 "
+    ,
+    {0x1f, 0x0a, 0x1f} // 0x23 #
+    ,
+    {0x12, 0x1f, 0x09} // 0x24 $
+    ,
+    {0x19, 0x04, 0x13} // 0x25 %
+    ,
+    {0x0a, 0x15, 0x1a} // 0x26 &
+    ,
+    {0x00, 0x03, 0x00} // 0x27 '
+    ,
+    {0x00, 0x0e, 0x11} // 0x28 (
+    ,
+    {0x11, 0x0e, 0x00} // 0x29 )
+    ,
+    {0x0a, 0x04, 0x0a} // 0x2a *
+    ,
+    {0x04, 0x0e, 0x04} // 0x2b +
+    ,
+    {0x10, 0x08, 0x00} // 0x2c ,
+    ,
+    {0x04, 0x04, 0x04} // 0x2d -
+    ,
+    {0x00, 0x10, 0x00} // 0x2e .
+    ,
+    {0x18, 0x04, 0x03} // 0x2f /
+    ,
+    {0x1f, 0x11, 0x1f} // 0x30 0
+    ,
+    {0x12, 0x1f, 0x10} // 0x31 1
+    ,
+    {0x19, 0x15, 0x12} // 0x32 2
+    ,
+    {0x11, 0x15, 0x0a} // 0x33 3
+    ,
+    {0x07, 0x04, 0x1f} // 0x34 4
+    ,
+    {0x17, 0x15, 0x09} // 0x35 5
+    ,
+    {0x1e, 0x15, 0x1d} // 0x36 6
+    ,
+    {0x01, 0x1d, 0x03} // 0x37 7
+    ,
+    {0x1f, 0x15, 0x1f} // 0x38 8
+    ,
+    {0x17, 0x15, 0x0f} // 0x39 9
+    ,
+    {0x00, 0x0a, 0x00} // 0x3a :
+    ,
+    {0x10, 0x0a, 0x00} // 0x3b ;
+    ,
+    {0x04, 0x0a, 0x11} // 0x3c <
+    ,
+    {0x0a, 0x0a, 0x0a} // 0x3d =
+    ,
+    {0x11, 0x0a, 0x04} // 0x3e >
+    ,
+    {0x01, 0x15, 0x02} // 0x3f ?
+    ,
+    {0x0e, 0x15, 0x16} // 0x40 @
+    ,
+    {0x1e, 0x05, 0x1e} // 0x41 A
+    ,
+    {0x1f, 0x15, 0x0a} // 0x42 B
+    ,
+    {0x0e, 0x11, 0x11} // 0x43 C
+    ,
+    {0x1f, 0x11, 0x0e} // 0x44 D
+    ,
+    {0x1f, 0x15, 0x11} // 0x45 E
+    ,
+    {0x1f, 0x05, 0x01} // 0x46 F
+    ,
+    {0x0e, 0x11, 0x1d} // 0x47 G
+    ,
+    {0x1f, 0x04, 0x1f} // 0x48 H
+    ,
+    {0x11, 0x1f, 0x11} // 0x49 I
+    ,
+    {0x08, 0x10, 0x0f} // 0x4a J
+    ,
+    {0x1f, 0x04, 0x1b} // 0x4b K
+    ,
+    {0x1f, 0x10, 0x10} // 0x4c L
+    ,
+    {0x1f, 0x06, 0x1f} // 0x4d M
+    ,
+    {0x1f, 0x01, 0x1e} // 0x4e N
+    ,
+    {0x0e, 0x11, 0x0e} // 0x4f O
+    ,
+    {0x1f, 0x05, 0x02} // 0x50 P
+    ,
+    {0x0e, 0x19, 0x1e} // 0x51 Q
+    ,
+    {0x1f, 0x05, 0x1a} // 0x52 R
+    ,
+    {0x12, 0x15, 0x09} // 0x53 S
+    ,
+    {0x01, 0x1f, 0x01} // 0x54 T
+    ,
+    {0x1f, 0x10, 0x1f} // 0x55 U
+    ,
+    {0x07, 0x18, 0x07} // 0x56 V
+    ,
+    {0x1f, 0x0c, 0x1f} // 0x57 W
+    ,
+    {0x1b, 0x04, 0x1b} // 0x58 X
+    ,
+    {0x03, 0x1c, 0x03} // 0x59 Y
+    ,
+    {0x19, 0x15, 0x13} // 0x5a Z
+    ,
+    {0x1f, 0x11, 0x00} // 0x5b [
+    ,
+    {0x03, 0x04, 0x18} // 0x5c \ (keep this to escape the backslash)
+    ,
+    {0x00, 0x11, 0x1f} // 0x5d ]
+    ,
+    {0x02, 0x01, 0x02} // 0x5e ^
+    ,
+    {0x10, 0x10, 0x10} // 0x5f _
+    ,
+    {0x01, 0x02, 0x00} // 0x60 `
+    ,
+    {0x1e, 0x05, 0x1e} // 0x61 a (small caps)
+    ,
+    {0x1f, 0x15, 0x0a} // 0x62 b (small caps)
+    ,
+    {0x0e, 0x11, 0x11} // 0x63 c (small caps)
+    ,
+    {0x1f, 0x11, 0x0e} // 0x64 d (small caps)
+    ,
+    {0x1f, 0x15, 0x11} // 0x65 e (small caps)
+    ,
+    {0x1f, 0x05, 0x01} // 0x66 f (small caps)
+    ,
+    {0x0e, 0x11, 0x1d} // 0x67 g (small caps)
+    ,
+    {0x1f, 0x04, 0x1f} // 0x68 h (small caps)
+    ,
+    {0x11, 0x1f, 0x11} // 0x69 i (small caps)
+    ,
+    {0x08, 0x10, 0x0f} // 0x6a j (small caps)
+    ,
+    {0x1f, 0x04, 0x1b} // 0x6b k (small caps)
+    ,
+    {0x1f, 0x10, 0x10} // 0x6c l (small caps)
+    ,
+    {0x1f, 0x06, 0x1f} // 0x6d m (small caps)
+    ,
+    {0x1f, 0x01, 0x1e} // 0x6e n (small caps)
+    ,
+    {0x0e, 0x11, 0x0e} // 0x6f o (small caps)
+    ,
+    {0x1f, 0x05, 0x02} // 0x70 p (small caps)
+    ,
+    {0x0e, 0x19, 0x1e} // 0x71 q (small caps)
+    ,
+    {0x1f, 0x05, 0x1a} // 0x72 r (small caps)
+    ,
+    {0x12, 0x15, 0x09} // 0x73 s (small caps)
+    ,
+    {0x01, 0x1f, 0x01} // 0x74 t (small caps)
+    ,
+    {0x1f, 0x10, 0x1f} // 0x75 u (small caps)
+    ,
+    {0x07, 0x18, 0x07} // 0x76 v (small caps)
+    ,
+    {0x1f, 0x0c, 0x1f} // 0x77 w (small caps)
+    ,
+    {0x1b, 0x04, 0x1b} // 0x78 x (small caps)
+    ,
+    {0x03, 0x1c, 0x03} // 0x79 y (small caps)
+    ,
+    {0x19, 0x15, 0x13} // 0x7a z (small caps)
+    ,
+    {0x04, 0x1f, 0x11} // 0x7b {
+    ,
+    {0x00, 0x1f, 0x00} // 0x7c |
+    ,
+    {0x11, 0x1f, 0x04} // 0x7d }
+    ,
+    {0x04, 0x06, 0x02} // 0x7e ~
+    ,
+    {0x00, 0x00, 0x00} // 0x7f DEL
+};
+
 /* The displayMap variable stores a buffer representation of the
 pixels on our display. There are 504 total bits in this array,
 same as how many pixels there are on a 84 x 48 display.
@@ -0,0 +1,147 @@
+#ifndef __NOKIA_5110_CODEC_H__
+#define __NOKIA_5110_CODEC_H__
+
+/* Frame codecs of NOKIA_5110_FMT_RLE and NOKIA_5110_FMT_DELTA.  Both
+are PackBits: a control byte n of 0-127 is followed by n + 1 literal
+bytes, one of 129-255 by a single byte repeated 257 - n times, and 128
+is skipped.  A DELTA frame is the XOR of the new frame with the one
+being replaced, so unchanged areas pack into runs of zeros.  Shared by
+the driver and the userspace tools, like nokia_5110_convert.h. */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+/* Largest packed size of len bytes, one control byte per 128 literals */
+#define NOKIA_PACKBITS_BOUND(len) ((len) + ((len) + 127) / 128)
+
+/********************************************************
+ *
+ * Packs a buffer, runs of 3 or more equal bytes become
+ *  repeats and everything else literals
+ *  params:
+ *       src - bytes to pack
+ *       len - bytes in src
+ *       dst - NOKIA_PACKBITS_BOUND(len) bytes out
+ *  Returns the packed size.
+ *
+ *********************************************************/
+static inline size_t nokia_packbits_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+    size_t in = 0;
+    size_t out = 0;
+    size_t n;
+
+    while (in < len)
+    {
+        for (n = 1; in + n < len && n < 128 && src[in + n] == src[in]; n++)
+        {
+        }
+
+        if (n >= 3)
+        {
+            dst[out++] = (uint8_t)(257 - n);
+            dst[out++] = src[in];
+            in += n;
+            continue;
+        }
+
+        // literals up to the next run worth a repeat
+        for (n = 0; in + n < len && n < 128; n++)
+        {
+            if (in + n + 2 < len && src[in + n] == src[in + n + 1] && src[in + n] == src[in + n + 2])
+            {
+                break;
+            }
+        }
+        dst[out++] = (uint8_t)(n - 1);
+        for (; n; n--)
+        {
+            dst[out++] = src[in++];
+        }
+    }
+
+    return out;
+}
+
+/********************************************************
+ *
+ * Unpacks a buffer packed by nokia_packbits_encode()
+ *  params:
+ *       src - packed bytes
+ *       len - bytes in src
+ *       dst - dst_len bytes out
+ *       dst_len - room in dst
+ *  Returns the unpacked size, or -1 when src is cut short
+ *  or unpacks to more than dst_len bytes.
+ *
+ *********************************************************/
+static inline long nokia_packbits_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t dst_len)
+{
+    size_t in = 0;
+    size_t out = 0;
+    size_t n;
+
+    while (in < len)
+    {
+        uint8_t c = src[in++];
+
+        if (c < 128)
+        {
+            n = (size_t)c + 1;
+            if (n > len - in || n > dst_len - out)
+            {
+                return -1;
+            }
+            for (; n; n--)
+            {
+                dst[out++] = src[in++];
+            }
+        }
+        else if (c > 128)
+        {
+            n = 257 - (size_t)c;
+            if (in == len || n > dst_len - out)
+            {
+                return -1;
+            }
+            for (; n; n--)
+            {
+                dst[out++] = src[in];
+            }
+            in++;
+        }
+    }
+
+    return (long)out;
+}
+
+/********************************************************
+ *
+ * Packs the difference between two frames for
+ *  NOKIA_5110_FMT_DELTA
+ *  params:
+ *       prev - frame on the device
+ *       next - frame to show
+ *       len - bytes per frame
+ *       delta - len bytes of scratch
+ *       dst - NOKIA_PACKBITS_BOUND(len) bytes out
+ *  Returns the packed size.
+ *
+ *********************************************************/
+static inline size_t nokia_delta_encode(const uint8_t *prev, const uint8_t *next, size_t len, uint8_t *delta, uint8_t *dst)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        delta[i] = prev[i] ^ next[i];
+    }
+
+    return nokia_packbits_encode(delta, len, dst);
+}
+
+#endif // __NOKIA_5110_CODEC_H__
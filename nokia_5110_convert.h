@@ -0,0 +1,183 @@
+#ifndef __NOKIA_5110_CONVERT_H__
+#define __NOKIA_5110_CONVERT_H__
+
+/* Bitmap conversion kernels.  The panel wants each byte to be an
+8-pixel vertical strip with the LSB on top, 84 bytes per bank, while
+images usually come row-major.  These helpers are shared by the driver
+and the userspace tools, so they only rely on the fixed size types. */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <stddef.h>
+#endif
+
+/* 4x4 ordered dither thresholds, scaled to 0-255 */
+static const uint8_t nokia_bayer4[4][4] =
+{
+    {   8, 136,  40, 168 },
+    { 200,  72, 232, 104 },
+    {  56, 184,  24, 152 },
+    { 248, 120, 216,  88 }
+};
+
+/********************************************************
+ *
+ * Transposes an 8x8 bit matrix with three delta swaps
+ *  params:
+ *       rows - 8 row bytes, row 0 first, MSB is the left pixel
+ *       stride - distance between row bytes
+ *       cols - 8 column bytes out, LSB is the top pixel
+ *
+ *********************************************************/
+static inline void nokia_transpose8(const uint8_t *rows, size_t stride, uint8_t *cols)
+{
+    uint64_t x = 0;
+    uint64_t t;
+    int i;
+
+    // row 0 goes in the low byte so the transposed bits come out LSB on top
+    for (i = 0; i < 8; i++)
+    {
+        x |= (uint64_t)rows[i * stride] << (8 * i);
+    }
+
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+
+    for (i = 0; i < 8; i++)
+    {
+        cols[i] = (uint8_t)(x >> (8 * (7 - i)));
+    }
+}
+
+/********************************************************
+ *
+ * Converts a row-major 1-bpp bitmap to the panel layout
+ *  params:
+ *       src - rows of stride bytes, MSB is the left pixel, 1 is black
+ *       stride - bytes per source row, at least (width + 7) / 8
+ *       dst - width bytes per bank, height / 8 banks
+ *       width - pixels per row
+ *       height - rows, a multiple of 8
+ *
+ *********************************************************/
+static inline void nokia_mono_to_native(const uint8_t *src, size_t stride, uint8_t *dst, int width, int height)
+{
+    uint8_t cols[8];
+    int bank, xb, i;
+
+    for (bank = 0; bank < height / 8; bank++)
+    {
+        const uint8_t *rows = src + (size_t)bank * 8 * stride;
+        uint8_t *out = dst + (size_t)bank * width;
+
+        for (xb = 0; xb < width; xb += 8)
+        {
+            int n = (width - xb < 8) ? width - xb : 8;
+
+            nokia_transpose8(rows + xb / 8, stride, cols);
+            for (i = 0; i < n; i++)
+            {
+                out[xb + i] = cols[i];
+            }
+        }
+    }
+}
+
+// Pixel at a time reference version of nokia_mono_to_native()
+static inline void nokia_mono_to_native_scalar(const uint8_t *src, size_t stride, uint8_t *dst, int width, int height)
+{
+    int x, y;
+
+    for (y = 0; y < height; y++)
+    {
+        for (x = 0; x < width; x++)
+        {
+            uint8_t *out = &dst[(y / 8) * width + x];
+            const uint8_t bit = 1 << (y % 8);
+
+            if (src[y * stride + x / 8] & (0x80 >> (x % 8)))
+            {
+                *out |= bit;
+            }
+            else
+            {
+                *out &= ~bit;
+            }
+        }
+    }
+}
+
+/********************************************************
+ *
+ * Converts an 8-bpp grayscale bitmap to row-major 1-bpp
+ *  params:
+ *       gray - width bytes per row, 0 is black
+ *       width - pixels per row
+ *       height - rows
+ *       threshold - pixels darker than this turn black
+ *       dither - nonzero to use a 4x4 ordered dither instead
+ *       mono - rows of stride bytes out, 1 is black
+ *       stride - bytes per output row
+ *
+ *********************************************************/
+static inline void nokia_gray_to_mono(const uint8_t *gray, int width, int height, uint8_t threshold, int dither, uint8_t *mono, size_t stride)
+{
+    int x, y, i;
+
+    for (y = 0; y < height; y++)
+    {
+        const uint8_t *row = gray + (size_t)y * width;
+        uint8_t *out = mono + (size_t)y * stride;
+
+        for (x = 0; x < width; x += 8)
+        {
+            int n = (width - x < 8) ? width - x : 8;
+            uint8_t byte = 0;
+
+            for (i = 0; i < n; i++)
+            {
+                uint8_t limit = dither ? nokia_bayer4[y & 3][(x + i) & 3] : threshold;
+
+                byte |= (uint8_t)((row[x + i] < limit) << (7 - i));
+            }
+            out[x / 8] = byte;
+        }
+    }
+}
+
+/********************************************************
+ *
+ * Expands a 2-bpp grayscale bitmap to 8-bpp
+ *  params:
+ *       src - rows of (width + 3) / 4 bytes, the top bits
+ *             are the left pixel, 0 is black
+ *       width - pixels per row
+ *       height - rows
+ *       gray - width bytes per row out, levels 0, 85, 170, 255
+ *
+ *********************************************************/
+static inline void nokia_gray2_to_gray8(const uint8_t *src, int width, int height, uint8_t *gray)
+{
+    const size_t stride = ((size_t)width + 3) / 4;
+    int x, y;
+
+    for (y = 0; y < height; y++)
+    {
+        const uint8_t *row = src + (size_t)y * stride;
+        uint8_t *out = gray + (size_t)y * width;
+
+        for (x = 0; x < width; x++)
+        {
+            out[x] = (uint8_t)(((row[x / 4] >> (6 - 2 * (x % 4))) & 3) * 85);
+        }
+    }
+}
+
+#endif // __NOKIA_5110_CONVERT_H__
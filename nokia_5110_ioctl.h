@@ -0,0 +1,211 @@
+#ifndef __NOKIA_5110_IOCTL_H__
+#define __NOKIA_5110_IOCTL_H__
+
+/* Userspace interface of the nokia device.  This header is shared
+by the driver and applications, so it only uses the fixed size
+__u types. */
+
+#include <linux/types.h>
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#else
+#include <sys/ioctl.h>
+#endif
+
+/* Write modes:
+NOKIA_5110_MODE_TEXT - write() takes ASCII characters
+NOKIA_5110_MODE_GRPH - write() takes raw framebuffer bytes, each one
+                       an 8-pixel vertical strip, width per bank
+NOKIA_5110_MODE_CHART - write() takes strip chart samples, one byte
+                       each, 0 plots on the bottom row and 255 on the
+                       top one, see NOKIA_5110_IOC_SET_CHART */
+typedef enum
+{
+	NOKIA_5110_MODE_TEXT = 0,
+	NOKIA_5110_MODE_GRPH = 1,
+	NOKIA_5110_MODE_CHART = 2,
+	NOKIA_5110_MODE_COM = 3,
+	NOKIA_5110_MODE_END = 4
+} nokia_5110_mode ;
+
+/* Graphics mode pixel formats:
+NOKIA_5110_FMT_NATIVE - framebuffer bytes, written at the file position
+NOKIA_5110_FMT_MONO   - whole frames, row-major 1-bpp, (width + 7) / 8 bytes
+                        per row, MSB is the left pixel, 1 is black
+NOKIA_5110_FMT_GRAY8  - whole frames, row-major 8-bpp, 0 is black
+NOKIA_5110_FMT_REGIONS - framebuffer regions, each a nokia_5110_range
+                        followed by its bytes, all shown by the same
+                        refresh
+NOKIA_5110_FMT_RLE    - whole frames of framebuffer bytes, PackBits
+                        packed, see nokia_5110_codec.h
+NOKIA_5110_FMT_DELTA  - like RLE, but of the XOR of the new frame with
+                        what the framebuffer holds
+NOKIA_5110_FMT_FRM_GRAY8 - whole frames, row-major 8-bpp, 0 is black,
+                        shown in 4 gray levels by cycling bit-planes
+NOKIA_5110_FMT_FRM_GRAY2 - like FRM_GRAY8, but 2-bpp, (width + 3) / 4
+                        bytes per row, the top bits are the left pixel */
+#define NOKIA_5110_FMT_NATIVE   0
+#define NOKIA_5110_FMT_MONO     1
+#define NOKIA_5110_FMT_GRAY8    2
+#define NOKIA_5110_FMT_REGIONS  3
+#define NOKIA_5110_FMT_RLE      4
+#define NOKIA_5110_FMT_DELTA    5
+#define NOKIA_5110_FMT_FRM_GRAY8 6
+#define NOKIA_5110_FMT_FRM_GRAY2 7
+
+/* Most regions one NOKIA_5110_FMT_REGIONS write takes */
+#define NOKIA_5110_MAX_REGIONS  16
+
+/* MONO row stride of a single panel, tiled surfaces use (width + 7) / 8 */
+#define NOKIA_5110_MONO_STRIDE  11
+
+struct nokia_5110_format
+{
+    __u32 format;
+    __u8 threshold;     // GRAY8: pixels darker than this turn black
+    __u8 dither;        // GRAY8: nonzero for a 4x4 ordered dither instead
+    __u8 reserved[2];
+};
+
+/* Text mode fonts, width x height in pixels */
+#define NOKIA_5110_FONT_5X8     0
+#define NOKIA_5110_FONT_3X5     1
+#define NOKIA_5110_FONT_10X16   2
+#define NOKIA_5110_FONT_6X10    3
+
+/* Buffering, see NOKIA_5110_IOC_SET_BUFFERING */
+#define NOKIA_5110_BUFFER_SINGLE 0
+#define NOKIA_5110_BUFFER_DOUBLE 1
+
+/* NOKIA_5110_IOC_FLIP flags:
+NOKIA_5110_FLIP_DROP - replace a frame the panels have not picked up
+                       yet instead of waiting for it */
+#define NOKIA_5110_FLIP_DROP    1
+
+/* Strip chart styles:
+NOKIA_5110_CHART_LINE - consecutive samples are joined by a line
+NOKIA_5110_CHART_BARS - each sample is a bar up from the bottom */
+#define NOKIA_5110_CHART_LINE   0
+#define NOKIA_5110_CHART_BARS   1
+
+/* Strip chart flags:
+NOKIA_5110_CHART_WRAP - samples go in at a cursor that wraps around at
+                        the right edge, overwriting the oldest ones,
+                        instead of the chart scrolling left */
+#define NOKIA_5110_CHART_WRAP   1
+
+struct nokia_5110_chart
+{
+    __u8 style;
+    __u8 flags;
+    __u8 reserved[2];
+};
+
+/* Layer flags:
+NOKIA_5110_LAYER_VISIBLE - the layer is composited, a hidden one keeps
+                        its contents but shows what is beneath */
+#define NOKIA_5110_LAYER_VISIBLE 1
+
+/* A file's layer, in surface pixels.  The window may hang over the
+edges, it is clipped to the surface.  Layers with a higher z are drawn
+on top, among equal ones the last one set. */
+struct nokia_5110_layer
+{
+    __s16 x;            // top left pixel of the window
+    __s16 y;
+    __u16 width;
+    __u16 height;
+    __s8 z;
+    __u8 flags;
+    __u8 reserved[2];
+};
+
+/* Byte range of the framebuffer, offset = bank * width + x, width
+being 84 for a single panel */
+struct nokia_5110_range
+{
+    __u32 offset;
+    __u32 len;
+};
+
+/* Sprite slots of each surface, see NOKIA_5110_IOC_SET_SPRITE */
+#define NOKIA_5110_SPRITES      32
+
+/* A bitmap for a sprite slot, laid out like the framebuffer: width
+bytes per 8-row band, LSB on top, (height + 7) / 8 bands.  A width
+and height of 0 empty the slot. */
+struct nokia_5110_sprite
+{
+    __u16 width;
+    __u16 height;
+    __u8 slot;
+    __u8 reserved[3];
+    __u64 bits;         // user pointer to the bitmap
+};
+
+/* Blit ops, how a sprite combines with the framebuffer:
+NOKIA_5110_BLIT_COPY - the sprite's rectangle is replaced
+NOKIA_5110_BLIT_OR   - black sprite pixels are drawn
+NOKIA_5110_BLIT_AND  - white sprite pixels are cleared
+NOKIA_5110_BLIT_XOR  - black sprite pixels are inverted */
+#define NOKIA_5110_BLIT_COPY    0
+#define NOKIA_5110_BLIT_OR      1
+#define NOKIA_5110_BLIT_AND     2
+#define NOKIA_5110_BLIT_XOR     3
+
+struct nokia_5110_blit
+{
+    __u8 slot;
+    __u8 op;
+    __s16 x;            // top left pixel, need not be bank aligned, clipped to the surface
+    __s16 y;
+};
+
+/* Most blits one NOKIA_5110_IOC_BLIT takes */
+#define NOKIA_5110_MAX_BLITS    64
+
+struct nokia_5110_blits
+{
+    __u32 count;
+    __u32 reserved;
+    __u64 blits;        // user pointer to count nokia_5110_blit
+};
+
+#define NOKIA_5110_IOC_MAGIC 'N'
+
+/* Select the write mode, arg is a nokia_5110_mode value */
+#define NOKIA_5110_IOC_SET_MODE         _IO(NOKIA_5110_IOC_MAGIC, 0)
+/* Queue a refresh of the whole framebuffer, e.g. after drawing through mmap() */
+#define NOKIA_5110_IOC_FLUSH            _IO(NOKIA_5110_IOC_MAGIC, 1)
+/* Queue a refresh of a byte range of the framebuffer */
+#define NOKIA_5110_IOC_FLUSH_RANGE      _IOW(NOKIA_5110_IOC_MAGIC, 2, struct nokia_5110_range)
+/* Select the graphics mode pixel format */
+#define NOKIA_5110_IOC_SET_FORMAT       _IOW(NOKIA_5110_IOC_MAGIC, 3, struct nokia_5110_format)
+/* Select the text font, arg is a NOKIA_5110_FONT_ value */
+#define NOKIA_5110_IOC_SET_FONT         _IO(NOKIA_5110_IOC_MAGIC, 4)
+/* Read the count of panel refreshes so far into a __u32, which also
+clears POLLPRI for this file until the next one */
+#define NOKIA_5110_IOC_PRESENTED        _IOR(NOKIA_5110_IOC_MAGIC, 5, __u32)
+/* Select single or double buffering, arg is a NOKIA_5110_BUFFER_
+value.  Double buffered, write() and mmap() page 1 draw into a back
+buffer that starts out as a copy of the screen. */
+#define NOKIA_5110_IOC_SET_BUFFERING    _IO(NOKIA_5110_IOC_MAGIC, 6)
+/* Queue the back buffer as the next frame, arg is NOKIA_5110_FLIP_
+flags.  Waits, or fails with EAGAIN under O_NONBLOCK, until the
+previous frame was picked up. */
+#define NOKIA_5110_IOC_FLIP             _IO(NOKIA_5110_IOC_MAGIC, 7)
+/* Upload a bitmap into a sprite slot, replacing what it held */
+#define NOKIA_5110_IOC_SET_SPRITE       _IOW(NOKIA_5110_IOC_MAGIC, 8, struct nokia_5110_sprite)
+/* Draw a batch of sprites, in order and as one update.  Waits, or fails
+with EAGAIN under O_NONBLOCK, like write(). */
+#define NOKIA_5110_IOC_BLIT             _IOW(NOKIA_5110_IOC_MAGIC, 9, struct nokia_5110_blits)
+/* Set up the strip chart of NOKIA_5110_MODE_CHART and restart it at
+the left edge.  What is on screen stays until samples replace it. */
+#define NOKIA_5110_IOC_SET_CHART        _IOW(NOKIA_5110_IOC_MAGIC, 10, struct nokia_5110_chart)
+/* Make this file a layer, or move, restack, show or hide its layer.
+From then on write() on the file takes framebuffer bytes into a
+private framebuffer, whatever the mode and format, which shows through
+the window above the shared one until the file is closed. */
+#define NOKIA_5110_IOC_SET_LAYER        _IOW(NOKIA_5110_IOC_MAGIC, 11, struct nokia_5110_layer)
+
+#endif // __NOKIA_5110_IOCTL_H__
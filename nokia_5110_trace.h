@@ -0,0 +1,123 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM nokia_5110
+
+#if !defined(__NOKIA_5110_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __NOKIA_5110_TRACE_H__
+
+/* Tracepoints of the write and flush paths, under
+/sys/kernel/debug/tracing/events/nokia_5110/.  They cost a branch
+when disabled. */
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(nokia_5110_write_start,
+
+    TP_PROTO(int minor, size_t len, int mode),
+
+    TP_ARGS(minor, len, mode),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(size_t, len)
+        __field(int, mode)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->len = len;
+        __entry->mode = mode;
+    ),
+
+    TP_printk("nokia%d len=%zu mode=%d", __entry->minor, __entry->len, __entry->mode)
+);
+
+TRACE_EVENT(nokia_5110_write_end,
+
+    TP_PROTO(int minor, ssize_t ret),
+
+    TP_ARGS(minor, ret),
+
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(ssize_t, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("nokia%d ret=%zd", __entry->minor, __entry->ret)
+);
+
+TRACE_EVENT(nokia_5110_flush_start,
+
+    TP_PROTO(int panel),
+
+    TP_ARGS(panel),
+
+    TP_STRUCT__entry(
+        __field(int, panel)
+    ),
+
+    TP_fast_assign(
+        __entry->panel = panel;
+    ),
+
+    TP_printk("panel=%d", __entry->panel)
+);
+
+TRACE_EVENT(nokia_5110_flush_end,
+
+    TP_PROTO(int panel, size_t bytes, int segments, int ret),
+
+    TP_ARGS(panel, bytes, segments, ret),
+
+    TP_STRUCT__entry(
+        __field(int, panel)
+        __field(size_t, bytes)
+        __field(int, segments)
+        __field(int, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->panel = panel;
+        __entry->bytes = bytes;
+        __entry->segments = segments;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("panel=%d bytes=%zu segments=%d ret=%d", __entry->panel, __entry->bytes, __entry->segments, __entry->ret)
+);
+
+// One command or data run on the bus
+TRACE_EVENT(nokia_5110_xfer,
+
+    TP_PROTO(int panel, int dc, size_t len, u64 ns),
+
+    TP_ARGS(panel, dc, len, ns),
+
+    TP_STRUCT__entry(
+        __field(int, panel)
+        __field(int, dc)
+        __field(size_t, len)
+        __field(u64, ns)
+    ),
+
+    TP_fast_assign(
+        __entry->panel = panel;
+        __entry->dc = dc;
+        __entry->len = len;
+        __entry->ns = ns;
+    ),
+
+    TP_printk("panel=%d %s len=%zu ns=%llu", __entry->panel, __entry->dc ? "data" : "cmd", __entry->len, __entry->ns)
+);
+
+#endif // __NOKIA_5110_TRACE_H__
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE nokia_5110_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,157 @@
+#!/bin/bash
+#
+# Loads nokia_5110 against a gpio-sim chip with pcd8544_emu attached and
+# times panel init, full frame and single glyph updates.  Fails when the
+# emulator saw a protocol error or a latency exceeds its limit.
+#
+# Needs the kernel the module is built for, 6.6 or later, with
+# CONFIG_GPIO_SIM and CONFIG_GPIO_SYSFS.
+#
+# Usage: sudo tools/bench.sh [runs]
+#
+# Environment:
+#   SCLK_HZ        bit-bang clock, low enough for the emulator to poll (1000)
+#   MAX_INIT_MS    limits in ms, 0 to only report (0)
+#   MAX_FRAME_MS
+#   MAX_GLYPH_MS
+
+RUNS=${1:-5}
+SCLK_HZ=${SCLK_HZ:-1000}
+MAX_INIT_MS=${MAX_INIT_MS:-0}
+MAX_FRAME_MS=${MAX_FRAME_MS:-0}
+MAX_GLYPH_MS=${MAX_GLYPH_MS:-0}
+
+TOOLS=$(cd "$(dirname "$0")" && pwd)
+MODULE=$TOOLS/../nokia_5110.ko
+SIM=/sys/kernel/config/gpio-sim/nokia_bench
+LOG=$(mktemp)
+status=0
+
+if [ ! -e "$MODULE" ]; then
+	echo -e "\033[31mBuild the module first, $MODULE not found\033[0m"
+	exit 1
+fi
+
+make -s -C "$TOOLS" pcd8544_emu || exit 1
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Runs a command and prints how long it took in ms
+time_ms() {
+	local start=$(now_ms)
+	"$@" || return 1
+	echo $(( $(now_ms) - start ))
+}
+
+# Waits for nokia0 to finish its bring-up, fails when it could not
+wait_ready() {
+	local state i
+
+	for i in $(seq 1200); do
+		state=$(cat /sys/class/nokia_5110/nokia0/state 2> /dev/null)
+		[ "$state" = ready ] && return 0
+		[ "$state" = failed ] && break
+		sleep 0.1
+	done
+	echo -e "\033[31mnokia0 did not come up: ${state:-no device}\033[0m" >&2
+	return 1
+}
+
+# Loads the module, the panels are brought up after insmod returns
+load_module() {
+	insmod "$MODULE" "$@" && wait_ready
+}
+
+# Writes text to the panel and waits until it has been sent
+panel_write() {
+	printf "$1" | dd of=/dev/nokia0 conv=fsync status=none
+}
+
+check() {
+	local name=$1 ms=$2 limit=$3
+
+	if [ "$limit" -gt 0 ] && [ "$ms" -gt "$limit" ]; then
+		echo -e "\033[31m$name: $ms ms, over the $limit ms limit\033[0m"
+		status=1
+	else
+		echo "$name: $ms ms"
+	fi
+}
+
+cleanup() {
+	rmmod nokia_5110 2> /dev/null
+	[ -n "$emu" ] && kill -INT $emu 2> /dev/null && wait $emu
+	if [ -d $SIM ]; then
+		echo 0 > $SIM/live
+		rmdir $SIM/bank0/line* 2> /dev/null
+		rmdir $SIM/bank0 $SIM
+	fi
+	rm -f "$LOG"
+}
+trap cleanup EXIT
+
+# A simulated chip with one line per panel pin, in module parameter order
+modprobe gpio-sim || exit 1
+mkdir -p $SIM/bank0 || exit 1
+echo 5 > $SIM/bank0/num_lines
+echo nokia_bench > $SIM/bank0/label
+echo 1 > $SIM/live || exit 1
+
+chip_dir=/sys/devices/platform/$(cat $SIM/dev_name)/$(cat $SIM/bank0/chip_name)
+for chip in /sys/class/gpio/gpiochip*; do
+	if [ "$(cat $chip/label)" = nokia_bench ]; then
+		base=$(cat $chip/base)
+	fi
+done
+if [ -z "$base" ]; then
+	echo -e "\033[31mNo legacy GPIO numbers for the simulated chip\033[0m"
+	exit 1
+fi
+
+"$TOOLS"/pcd8544_emu -i 3600 "$chip_dir" > "$LOG" &
+emu=$!
+sleep 0.5
+
+echo "gpio-sim lines $base-$((base + 4)), sclk_hz=$SCLK_HZ"
+
+# from insmod until the panel is reset, initialized and showing the splash
+init_ms=$(time_ms load_module gpio_dc=$base gpio_rst=$((base + 1)) gpio_sce=$((base + 2)) \
+	gpio_dout=$((base + 3)) gpio_sclk=$((base + 4)) sclk_hz=$SCLK_HZ fbdev=0) || exit 1
+check "init" $init_ms $MAX_INIT_MS
+
+# wait for udev to create the node
+for i in $(seq 50); do
+	[ -w /dev/nokia0 ] && break
+	sleep 0.1
+done
+
+frame_total=0
+glyph_total=0
+for run in $(seq $RUNS); do
+	panel_write '\f'
+	# 14x6 cells of the 5x8 font cover the whole panel
+	frame_ms=$(time_ms panel_write "\033[H$(printf '%.0s#' $(seq 84))")
+	glyph_ms=$(time_ms panel_write "\033[3;7H$((run % 10))")
+	frame_total=$((frame_total + frame_ms))
+	glyph_total=$((glyph_total + glyph_ms))
+done
+check "full frame (mean of $RUNS)" $((frame_total / RUNS)) $MAX_FRAME_MS
+check "single glyph (mean of $RUNS)" $((glyph_total / RUNS)) $MAX_GLYPH_MS
+
+echo "gpio writes per byte: $(awk -v w=$(cat /sys/class/nokia_5110/nokia0/gpio_writes) \
+	-v b=$(cat /sys/class/nokia_5110/nokia0/bytes_sent) 'BEGIN { printf "%.1f", b ? w / b : 0 }')"
+
+rmmod nokia_5110
+kill -INT $emu
+wait $emu
+emu_status=$?
+emu=
+tail -n 1 "$LOG"
+if [ $emu_status -ne 0 ]; then
+	echo -e "\033[31mEmulator reported protocol errors\033[0m"
+	status=1
+fi
+
+exit $status
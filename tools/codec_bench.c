@@ -0,0 +1,185 @@
+/*******************************************************************
+
+Title: codec_bench.c
+Purpose:  Compares the upload size of raw, RLE and DELTA frames (see
+nokia_5110_codec.h) on representative screens of the 84x48 panel: a
+text dashboard with a ticking clock, a scrolling sparkline and a
+moving full-screen dithered image.  Every packed frame is unpacked
+again and checked against the original.
+
+Usage: codec_bench [frames]
+
+*******************************************************************/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../nokia_5110_convert.h"
+#include "../nokia_5110_codec.h"
+#include "../nokia_5110.h"
+
+#define MONO_STRIDE ((LCD_WIDTH + 7) / 8)
+#define NATIVE_LEN (LCD_WIDTH * LCD_BANKS)
+
+struct result
+{
+    size_t rle;
+    size_t delta;
+    double encode_sec;
+    double decode_sec;
+};
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Draws text with the 5x8 font at a bank and column, like text mode does
+static void draw_text(uint8_t *frame, int bank, int x, const char *text)
+{
+    int i;
+
+    for (; *text && x + 6 <= LCD_WIDTH; text++, x += 6)
+    {
+        for (i = 0; i < 5; i++)
+        {
+            frame[bank * LCD_WIDTH + x + i] = ASCII[*text - 0x20][i];
+        }
+        frame[bank * LCD_WIDTH + x + 5] = 0;
+    }
+}
+
+static void dashboard(uint8_t *frame, int n)
+{
+    char line[16];
+
+    memset(frame, 0, NATIVE_LEN);
+    draw_text(frame, 0, 0, "PUMP STATION");
+    snprintf(line, sizeof(line), "%02d:%02d:%02d", 12 + n / 3600 % 12, n / 60 % 60, n % 60);
+    draw_text(frame, 1, 18, line);
+    snprintf(line, sizeof(line), "FLOW %3d L/M", 120 + (n / 5) % 7);
+    draw_text(frame, 3, 0, line);
+    snprintf(line, sizeof(line), "TEMP  %2d.%dC", 21 + (n / 30) % 3, (n / 7) % 10);
+    draw_text(frame, 4, 0, line);
+    draw_text(frame, 5, 0, (n / 10) % 2 ? "STATUS   OK" : "STATUS   --");
+}
+
+// A trace scrolling one column per frame through banks 2-5
+static void sparkline(uint8_t *frame, int n)
+{
+    int x;
+
+    memset(frame, 0, NATIVE_LEN);
+    draw_text(frame, 0, 0, "LOAD");
+    for (x = 0; x < LCD_WIDTH; x++)
+    {
+        double t = (n + x) * 0.15;
+        int y = 16 + (int)(15.5 + 13 * sin(t) + 2 * sin(t * 3.7));
+
+        frame[(y / 8) * LCD_WIDTH + x] |= 1 << (y % 8);
+    }
+}
+
+// A moving radial gradient, ordered dithered, nearly every byte changes
+static void image(uint8_t *frame, int n)
+{
+    static uint8_t gray[LCD_WIDTH * LCD_HEIGHT];
+    static uint8_t mono[MONO_STRIDE * LCD_HEIGHT];
+    int x, y;
+
+    for (y = 0; y < LCD_HEIGHT; y++)
+    {
+        for (x = 0; x < LCD_WIDTH; x++)
+        {
+            double dx = x - 42 - 20 * sin(n * 0.05);
+            double dy = y - 24 - 10 * cos(n * 0.07);
+
+            gray[y * LCD_WIDTH + x] = (uint8_t)(127.5 + 127.5 * sin(sqrt(dx * dx + dy * dy) * 0.3));
+        }
+    }
+    nokia_gray_to_mono(gray, LCD_WIDTH, LCD_HEIGHT, 0, 1, mono, MONO_STRIDE);
+    nokia_mono_to_native(mono, MONO_STRIDE, frame, LCD_WIDTH, LCD_HEIGHT);
+}
+
+static int run(const char *name, void (*draw)(uint8_t *, int), int frames)
+{
+    static uint8_t prev[NATIVE_LEN], next[NATIVE_LEN], scratch[NATIVE_LEN], check[NATIVE_LEN];
+    static uint8_t packed[NOKIA_PACKBITS_BOUND(NATIVE_LEN)];
+    struct result r = { 0 };
+    double start;
+    size_t len;
+    int n, i;
+
+    // the panel starts out blank
+    memset(prev, 0, sizeof(prev));
+
+    for (n = 0; n < frames; n++)
+    {
+        draw(next, n);
+
+        start = now_sec();
+        len = nokia_packbits_encode(next, NATIVE_LEN, packed);
+        r.encode_sec += now_sec() - start;
+        r.rle += len;
+
+        start = now_sec();
+        if (nokia_packbits_decode(packed, len, check, sizeof(check)) != NATIVE_LEN || memcmp(check, next, NATIVE_LEN))
+        {
+            fprintf(stderr, "%s: RLE frame %d does not unpack to the original\n", name, n);
+            return 1;
+        }
+        r.decode_sec += now_sec() - start;
+
+        start = now_sec();
+        len = nokia_delta_encode(prev, next, NATIVE_LEN, scratch, packed);
+        r.encode_sec += now_sec() - start;
+        r.delta += len;
+
+        // applied the way the driver does
+        if (nokia_packbits_decode(packed, len, check, sizeof(check)) != NATIVE_LEN)
+        {
+            fprintf(stderr, "%s: DELTA frame %d is malformed\n", name, n);
+            return 1;
+        }
+        for (i = 0; i < NATIVE_LEN; i++)
+        {
+            prev[i] ^= check[i];
+        }
+        if (memcmp(prev, next, NATIVE_LEN))
+        {
+            fprintf(stderr, "%s: DELTA frame %d does not reproduce the original\n", name, n);
+            return 1;
+        }
+    }
+
+    printf("%-12s %8d %8.1f %8.1f %10.0f %10.0f\n", name, NATIVE_LEN,
+           (double)r.rle / frames, (double)r.delta / frames,
+           r.encode_sec * 1e9 / (2 * frames), r.decode_sec * 1e9 / frames);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = (argc > 1) ? atoi(argv[1]) : 1000;
+
+    if (frames <= 0)
+    {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+
+    printf("bytes per frame, mean of %d frames\n", frames);
+    printf("%-12s %8s %8s %8s %10s %10s\n", "screen", "raw", "rle", "delta", "encode ns", "decode ns");
+
+    return run("dashboard", dashboard, frames) ||
+           run("sparkline", sparkline, frames) ||
+           run("image", image, frames);
+}
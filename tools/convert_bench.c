@@ -0,0 +1,114 @@
+/*******************************************************************
+
+Title: convert_bench.c
+Purpose:  Measures the frame rate of the bitmap conversion kernels in
+nokia_5110_convert.h against the panel's 84x48 geometry and checks
+the word-level transpose against the per-pixel reference.
+
+Usage: convert_bench [iterations]
+
+*******************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../nokia_5110_convert.h"
+#include "../nokia_5110.h"
+
+#define MONO_STRIDE ((LCD_WIDTH + 7) / 8)
+#define NATIVE_LEN (LCD_WIDTH * LCD_BANKS)
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, int iterations, double seconds)
+{
+    printf("%-28s %12.0f frames/s  %8.1f ns/frame\n", name, iterations / seconds, seconds * 1e9 / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = (argc > 1) ? atoi(argv[1]) : 100000;
+    static uint8_t gray[LCD_WIDTH * LCD_HEIGHT];
+    static uint8_t mono[MONO_STRIDE * LCD_HEIGHT];
+    static uint8_t native[NATIVE_LEN];
+    static uint8_t reference[NATIVE_LEN];
+    volatile uint8_t sink = 0;
+    double start;
+    int i;
+
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    srand(5110);
+    for (i = 0; i < (int)sizeof(gray); i++)
+    {
+        gray[i] = rand() & 0xff;
+    }
+    for (i = 0; i < (int)sizeof(mono); i++)
+    {
+        mono[i] = rand() & 0xff;
+    }
+
+    nokia_mono_to_native(mono, MONO_STRIDE, native, LCD_WIDTH, LCD_HEIGHT);
+    nokia_mono_to_native_scalar(mono, MONO_STRIDE, reference, LCD_WIDTH, LCD_HEIGHT);
+    if (memcmp(native, reference, NATIVE_LEN) != 0)
+    {
+        fprintf(stderr, "transpose kernel does not match the reference conversion\n");
+        return 1;
+    }
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++)
+    {
+        mono[i % sizeof(mono)] ^= 1;
+        nokia_mono_to_native(mono, MONO_STRIDE, native, LCD_WIDTH, LCD_HEIGHT);
+        sink ^= native[i % NATIVE_LEN];
+    }
+    report("mono -> native (transpose)", iterations, now_sec() - start);
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++)
+    {
+        mono[i % sizeof(mono)] ^= 1;
+        nokia_mono_to_native_scalar(mono, MONO_STRIDE, native, LCD_WIDTH, LCD_HEIGHT);
+        sink ^= native[i % NATIVE_LEN];
+    }
+    report("mono -> native (scalar)", iterations, now_sec() - start);
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++)
+    {
+        gray[i % sizeof(gray)] ^= 1;
+        nokia_gray_to_mono(gray, LCD_WIDTH, LCD_HEIGHT, 128, 0, mono, MONO_STRIDE);
+        nokia_mono_to_native(mono, MONO_STRIDE, native, LCD_WIDTH, LCD_HEIGHT);
+        sink ^= native[i % NATIVE_LEN];
+    }
+    report("gray8 threshold -> native", iterations, now_sec() - start);
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++)
+    {
+        gray[i % sizeof(gray)] ^= 1;
+        nokia_gray_to_mono(gray, LCD_WIDTH, LCD_HEIGHT, 0, 1, mono, MONO_STRIDE);
+        nokia_mono_to_native(mono, MONO_STRIDE, native, LCD_WIDTH, LCD_HEIGHT);
+        sink ^= native[i % NATIVE_LEN];
+    }
+    report("gray8 dither -> native", iterations, now_sec() - start);
+
+    // printed so the conversions cannot be optimized away
+    printf("checksum %02x\n", sink);
+
+    return 0;
+}
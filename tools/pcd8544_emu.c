@@ -0,0 +1,404 @@
+/*******************************************************************
+
+Title: pcd8544_emu.c
+Purpose:  Emulates a PCD8544 on gpio-sim lines so the driver can be
+exercised and timed without a panel.  The lines the driver drives are
+sampled through the gpio-sim sysfs value files, SCE/DC/SCLK/DIN edges
+are decoded into PCD8544 commands and data, and the 84x48 display RAM
+is kept up to date.  Frames/s, bytes/s and protocol errors are
+reported every interval and on exit.
+
+The lines are polled, so the driver has to clock slowly enough for
+every SCLK half period to be sampled at least once, e.g. sclk_hz=1000.
+
+Usage: pcd8544_emu [-v] [-i seconds] [-o image.pbm] chip-dir
+                   [dc rst sce dout sclk]
+
+chip-dir is the gpio-sim chip in sysfs, e.g.
+/sys/devices/platform/gpio-sim.0/gpiochip3, and the optional offsets
+select its lines (default 0 1 2 3 4, the module parameter order).
+
+*******************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../nokia_5110_convert.h"
+#include "../nokia_5110.h"
+
+enum { LINE_DC, LINE_RST, LINE_SCE, LINE_DOUT, LINE_SCLK, LINE_COUNT };
+
+static const char *line_names[LINE_COUNT] = { "dc", "rst", "sce", "dout", "sclk" };
+
+// Controller state, as set by the commands decoded so far
+struct pcd8544
+{
+    uint8_t ram[LCD_BANKS][LCD_WIDTH];
+    int x;
+    int y;
+    int power_down;
+    int vertical;
+    int extended;
+    int display;
+    int vop;
+    int bias;
+    int temp_coeff;
+
+    // serial interface
+    uint8_t shift;
+    int bits;
+};
+
+struct stats
+{
+    unsigned long transactions;
+    unsigned long frames;               // transactions that wrote display RAM
+    unsigned long command_bytes;
+    unsigned long data_bytes;
+    unsigned long resets;
+    unsigned long errors;
+};
+
+static volatile sig_atomic_t stop;
+static int verbose;
+
+static double now_sec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void protocol_error(struct stats *st, const char *what, int value)
+{
+    st->errors++;
+    fprintf(stderr, "protocol error: %s (0x%02x)\n", what, value);
+}
+
+static void pcd8544_reset(struct pcd8544 *lcd)
+{
+    memset(lcd, 0, sizeof(*lcd));
+    // the PCD8544 comes out of reset powered down with H = 0
+    lcd->power_down = 1;
+}
+
+// Handles one byte received with D/C low
+static void pcd8544_command(struct pcd8544 *lcd, struct stats *st, uint8_t c)
+{
+    st->command_bytes++;
+
+    if (c == LCD_COMMAND_NOP)
+    {
+        return;
+    }
+
+    if ((c & 0xf8) == LCD_COMMAND_FUNCT_SET)
+    {
+        lcd->power_down = !!(c & LCD_COMMAND_FUNCT_PWR_DOWN);
+        lcd->vertical = !!(c & LCD_COMMAND_FUNCT_VERT_ADDR);
+        lcd->extended = !!(c & LCD_COMMAND_FUNCT_EXT_H);
+        return;
+    }
+
+    if (!lcd->extended)
+    {
+        if (c & LCD_COMMAND_SET_X)
+        {
+            if ((c & 0x7f) >= LCD_WIDTH)
+            {
+                protocol_error(st, "X address out of range", c);
+                return;
+            }
+            lcd->x = c & 0x7f;
+        }
+        else if ((c & 0xf8) == LCD_COMMAND_SET_Y)
+        {
+            if ((c & 0x07) >= LCD_BANKS)
+            {
+                protocol_error(st, "Y address out of range", c);
+                return;
+            }
+            lcd->y = c & 0x07;
+        }
+        else if ((c & 0xfa) == LCD_COMMAND_DISP_CTRL)
+        {
+            lcd->display = c & 0x05;
+        }
+        else
+        {
+            protocol_error(st, "unknown basic instruction", c);
+        }
+    }
+    else
+    {
+        if (c & LCD_COMMAND_Vop)
+        {
+            lcd->vop = c & 0x7f;
+        }
+        else if ((c & 0xf8) == LCD_COMMAND_BIAS_SYS)
+        {
+            lcd->bias = c & 0x07;
+        }
+        else if ((c & 0xfc) == LCD_COMMAND_TEMP_CTRL)
+        {
+            lcd->temp_coeff = c & 0x03;
+        }
+        else
+        {
+            protocol_error(st, "unknown extended instruction", c);
+        }
+    }
+}
+
+// Handles one byte received with D/C high, the address advances like the controller's
+static void pcd8544_data(struct pcd8544 *lcd, struct stats *st, uint8_t d)
+{
+    st->data_bytes++;
+
+    lcd->ram[lcd->y][lcd->x] = d;
+
+    if (lcd->vertical)
+    {
+        if (++lcd->y == LCD_BANKS)
+        {
+            lcd->y = 0;
+            lcd->x = (lcd->x + 1) % LCD_WIDTH;
+        }
+    }
+    else
+    {
+        if (++lcd->x == LCD_WIDTH)
+        {
+            lcd->x = 0;
+            lcd->y = (lcd->y + 1) % LCD_BANKS;
+        }
+    }
+}
+
+static int read_line(int fd)
+{
+    char c;
+
+    if (pread(fd, &c, 1, 0) != 1)
+    {
+        return -1;
+    }
+
+    return c == '1';
+}
+
+// Writes the display RAM as a plain PBM, 1 is black like the panel
+static int write_pbm(const struct pcd8544 *lcd, const char *path)
+{
+    FILE *f = fopen(path, "w");
+    int x, y;
+
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(f, "P1\n%d %d\n", LCD_WIDTH, LCD_HEIGHT);
+    for (y = 0; y < LCD_HEIGHT; y++)
+    {
+        for (x = 0; x < LCD_WIDTH; x++)
+        {
+            fputc((lcd->ram[y / 8][x] & (1 << (y % 8))) ? '1' : '0', f);
+        }
+        fputc('\n', f);
+    }
+
+    return fclose(f);
+}
+
+static void report(const struct stats *st, const struct stats *last, double seconds)
+{
+    unsigned long bytes = st->command_bytes + st->data_bytes - last->command_bytes - last->data_bytes;
+
+    printf("%8.1f frames/s  %10.1f bytes/s  %lu transactions  %lu errors\n",
+           (st->frames - last->frames) / seconds, bytes / seconds, st->transactions, st->errors);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    int offsets[LINE_COUNT] = { 0, 1, 2, 3, 4 };
+    int fds[LINE_COUNT];
+    int level[LINE_COUNT];
+    const char *image = NULL;
+    double interval = 1.0;
+    struct pcd8544 lcd;
+    struct stats st = { 0 };
+    struct stats last = { 0 };
+    unsigned long txn_bytes = 0;
+    unsigned long txn_data = 0;
+    double txn_start = 0;
+    int in_txn = 0;
+    double start, last_report;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "vi:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'o':
+            image = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+
+    if (argc - optind != 1 && argc - optind != 1 + LINE_COUNT)
+    {
+        goto usage;
+    }
+    for (i = 0; i < LINE_COUNT && argc - optind > 1; i++)
+    {
+        offsets[i] = atoi(argv[optind + 1 + i]);
+    }
+
+    for (i = 0; i < LINE_COUNT; i++)
+    {
+        char path[512];
+
+        snprintf(path, sizeof(path), "%s/sim_gpio%d/value", argv[optind], offsets[i]);
+        fds[i] = open(path, O_RDONLY);
+        if (fds[i] < 0)
+        {
+            fprintf(stderr, "%s line: %s: %s\n", line_names[i], path, strerror(errno));
+            return 1;
+        }
+        level[i] = read_line(fds[i]);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    pcd8544_reset(&lcd);
+    start = last_report = now_sec();
+
+    while (!stop)
+    {
+        int sample[LINE_COUNT];
+        double now;
+
+        for (i = 0; i < LINE_COUNT; i++)
+        {
+            sample[i] = read_line(fds[i]);
+            if (sample[i] < 0)
+            {
+                break;
+            }
+        }
+        if (i < LINE_COUNT)
+        {
+            continue;
+        }
+        now = now_sec();
+
+        if (!sample[LINE_RST])
+        {
+            if (level[LINE_RST])
+            {
+                st.resets++;
+                if (verbose)
+                {
+                    printf("reset\n");
+                }
+            }
+            pcd8544_reset(&lcd);
+        }
+        else if (sample[LINE_SCE] != level[LINE_SCE])
+        {
+            if (!sample[LINE_SCE])
+            {
+                // start of a transaction, the serial interface restarts at bit 7
+                lcd.bits = 0;
+                txn_bytes = 0;
+                txn_data = st.data_bytes;
+                txn_start = now;
+                in_txn = 1;
+            }
+            else if (in_txn)
+            {
+                if (lcd.bits)
+                {
+                    protocol_error(&st, "SCE raised mid byte, bits", lcd.bits);
+                }
+                st.transactions++;
+                if (st.data_bytes != txn_data)
+                {
+                    st.frames++;
+                }
+                if (verbose)
+                {
+                    printf("txn %lu: %lu bytes, %lu data, %.3f ms\n", st.transactions, txn_bytes, st.data_bytes - txn_data, (now - txn_start) * 1e3);
+                }
+                in_txn = 0;
+            }
+        }
+        else if (!sample[LINE_SCE] && sample[LINE_SCLK] && !level[LINE_SCLK])
+        {
+            // DIN is sampled on the rising edge, D/C on the eighth one
+            lcd.shift = (lcd.shift << 1) | sample[LINE_DOUT];
+            if (++lcd.bits == 8)
+            {
+                if (sample[LINE_DC])
+                {
+                    pcd8544_data(&lcd, &st, lcd.shift);
+                }
+                else
+                {
+                    pcd8544_command(&lcd, &st, lcd.shift);
+                }
+                lcd.bits = 0;
+                txn_bytes++;
+            }
+        }
+
+        memcpy(level, sample, sizeof(level));
+
+        if (now - last_report >= interval)
+        {
+            report(&st, &last, now - last_report);
+            last = st;
+            last_report = now;
+        }
+    }
+
+    printf("total: %.1f s  %lu transactions  %lu frames  %lu command bytes  %lu data bytes  %lu resets  %lu errors\n",
+           now_sec() - start, st.transactions, st.frames, st.command_bytes, st.data_bytes, st.resets, st.errors);
+
+    if (image && write_pbm(&lcd, image))
+    {
+        return 1;
+    }
+
+    return st.errors ? 2 : 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-v] [-i seconds] [-o image.pbm] chip-dir [dc rst sce dout sclk]\n", argv[0]);
+    return 1;
+}